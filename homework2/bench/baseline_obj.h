@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include "scene.h"
+
+// The std::getline/std::stringstream OBJ/MTL parser loadOBJ replaced, kept as
+// bench_load's baseline: every corner its own vertex, a tangent frame per
+// triangle. Unchanged but for taking an undefined material as the defaults,
+// like loadOBJ, so it runs on the scenes without an MTL.
+
+static MaterialMap baselineLoadMTL(std::istream& stream) {
+    MaterialMap result;
+    std::string cur;
+
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (line.starts_with("#")) continue;
+        std::stringstream ss{line};
+        std::string cmd;
+        ss >> cmd;
+
+        if (cmd == "newmtl") {
+            ss >> cur;
+            continue;
+        }
+
+        auto& M = result.materials[cur];
+        if (cmd == "Ka") ss >> M.Ka.x >> M.Ka.y >> M.Ka.z;
+        if (cmd == "Kd") ss >> M.Kd.x >> M.Kd.y >> M.Kd.z;
+        if (cmd == "Ks") ss >> M.Ks.x >> M.Ks.y >> M.Ks.z;
+        if (cmd == "Ns") ss >> M.Ns;
+        if (cmd == "map_Ka") ss >> M.map_Ka;
+        if (cmd == "map_Kd") ss >> M.map_Kd;
+        if (cmd == "map_Ks") ss >> M.map_Ks;
+        if (cmd == "map_d") ss >> M.map_d;
+        if (cmd == "norm") ss >> M.norm;
+    }
+
+    return result;
+}
+
+static Scene baselineLoadOBJ(std::istream& stream, const MaterialMap& materials) {
+    Scene result;
+    std::vector<glm::vec3> v, vt, vn;
+    std::string material;
+
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (line.starts_with("#")) continue;
+        std::stringstream ss{line};
+        std::string cmd;
+        ss >> cmd;
+
+        if (cmd == "usemtl") {
+            ss >> material;
+            auto found = materials.materials.find(material);
+            result.objects[material].material = found != materials.materials.end() ? found->second : Material{};
+            continue;
+        }
+
+        auto& obj = result.objects[material];
+
+        if (cmd == "v") ss >> v.emplace_back().x >> v.back().y >> v.back().z;
+        if (cmd == "vt") ss >> vt.emplace_back().x >> vt.back().y >> vt.back().z;
+        if (cmd == "vn") ss >> vn.emplace_back().x >> vn.back().y >> vn.back().z;
+
+        if (cmd == "f") {
+            std::string face;
+            unsigned first = obj.vertices.size();
+            unsigned count = 0;
+            while (ss >> face) {
+                int vi, vti, vni;
+                char dummy;
+                std::stringstream fs{face};
+                fs >> vi >> dummy >> vti >> dummy >> vni;
+                --vi, --vti, --vni;
+
+                auto& vertex = obj.vertices.emplace_back();
+                vertex.position = v[vi];
+                vertex.texcoord = {vt[vti].x, vt[vti].y};
+                vertex.normal = vn[vni];
+
+                ++count;
+            }
+
+            for (unsigned i = 2; i < count; ++i) {
+                obj.indices.push_back(first);
+                obj.indices.push_back(first + i - 1);
+                obj.indices.push_back(first + i);
+
+                // calculate tangents and bitangents
+                auto& v1 = obj.vertices[first];
+                auto& v2 = obj.vertices[first + i - 1];
+                auto& v3 = obj.vertices[first + i];
+
+                auto edge1 = v2.position - v1.position;
+                auto edge2 = v3.position - v1.position;
+                auto duv1 = v2.texcoord - v1.texcoord;
+                auto duv2 = v3.texcoord - v1.texcoord;
+
+                float f = 1.0f / (duv1.x * duv2.y - duv2.x * duv1.y);
+                v1.tangent = v2.tangent = v3.tangent = f * (duv2.y * edge1 - duv1.y * edge2);
+                v1.bitangent = v2.bitangent = v3.bitangent = f * (-duv2.x * edge1 - duv1.x * edge2);
+            }
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,125 @@
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "mesh_optimize.h"
+#include "meshlets.h"
+#include "baseline_obj.h"
+
+// keeps the reads of the cooked arrays from being optimized out
+static volatile uint64_t sink;
+
+// best of `runs` calls of body, in ms
+static double bestOf(unsigned runs, auto body) {
+    double best = INFINITY;
+    for (unsigned i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// a scene without an MTL, like suzanne.obj and cube.obj, loads with the default materials
+static MaterialMap loadMaterials(const std::string& mtlPath) {
+    if (!std::filesystem::exists(mtlPath)) return {};
+    MappedFile mtlIn{mtlPath};
+    return loadMTL(mtlIn.view());
+}
+
+static Scene parse(const std::string& objPath, const std::string& mtlPath, unsigned threads) {
+    auto materials = loadMaterials(mtlPath);
+    MappedFile objIn{objPath};
+    return loadOBJ(objIn.view(), materials, threads);
+}
+
+static Scene parseBaseline(const std::string& objPath, const std::string& mtlPath) {
+    MaterialMap materials;
+    if (std::filesystem::exists(mtlPath)) {
+        std::ifstream mtlIn{mtlPath};
+        materials = baselineLoadMTL(mtlIn);
+    }
+    std::ifstream objIn{objPath};
+    if (!objIn) throw std::runtime_error{"failed to open " + objPath};
+    return baselineLoadOBJ(objIn, materials);
+}
+
+static void benchmarkScene(const std::string& objPath, unsigned runs) {
+    std::string mtlPath = std::filesystem::path{objPath}.replace_extension(".mtl").string();
+    std::string cachePath = (std::filesystem::temp_directory_path() / "bench_load.cache").string();
+    auto objStamp = SourceStamp::of(objPath), mtlStamp = SourceStamp::of(mtlPath);
+    double objMiB = objStamp.size / (1024.0 * 1024.0);
+    auto report = [&](const std::string& what, double ms, double baseline) {
+        std::cout << "  " << what << ": " << ms << " ms, " << objMiB / ms * 1000.0 << " MiB/s, " << baseline / ms << "x\n";
+    };
+
+    std::cout << objPath << " (" << objMiB << " MiB):\n";
+    double baseline = bestOf(runs, [&] { parseBaseline(objPath, mtlPath); });
+    report("getline/stringstream", baseline, baseline);
+    double fastest = bestOf(runs, [&] { parse(objPath, mtlPath, 1); });
+    report("mmap/from_chars, 1 thread", fastest, baseline);
+    if (workerCount() > 1) {
+        fastest = std::min(fastest, bestOf(runs, [&] { parse(objPath, mtlPath, workerCount()); }));
+        report("mmap/from_chars, " + std::to_string(workerCount()) + " threads", fastest, baseline);
+    }
+
+    auto scene = parse(objPath, mtlPath, workerCount());
+    optimizeScene(scene, workerCount());
+    buildSceneMeshlets(scene, workerCount());
+    if (!writeSceneCache(cachePath, scene, objStamp, mtlStamp)) throw std::runtime_error{"failed to write " + cachePath};
+
+    double cached = bestOf(runs, [&] {
+        auto cooked = loadSceneCache(cachePath, objStamp, mtlStamp);
+        if (!cooked) throw std::runtime_error{"failed to load " + cachePath};
+        uint64_t checksum = 0;
+        for (const auto& [_, obj] : cooked->objects) {
+            for (unsigned index : obj.indices) checksum += index;
+            for (const auto& vertex : obj.vertices) checksum += std::bit_cast<uint32_t>(vertex.position.x);
+        }
+        sink = checksum;
+    });
+    report("scene cache", cached, baseline);
+    std::filesystem::remove(cachePath);
+}
+
+// Load time of every scene given, best of the runs: the getline/stringstream
+// parser this tree started with, the mmap/from_chars one on one thread and on
+// workerCount(), and the scene cache cooked from it, reading every byte the
+// way the upload would. Speedups are over the first. CPU only, no context.
+int main(int argc, char** argv) {
+    unsigned runs = 5;
+    std::vector<std::string> scenes;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+                runs = std::stoul(argv[++i]);
+            } else if (argv[i][0] != '-') {
+                scenes.push_back(argv[i]);
+            } else {
+                scenes.clear();
+                break;
+            }
+        }
+    } catch (const std::logic_error&) { // a run count that is not a number
+        scenes.clear();
+    }
+    if (scenes.empty()) {
+        std::cerr << "usage: " << argv[0] << " [--runs N] scene.obj...\n";
+        return 1;
+    }
+
+    try {
+        for (const auto& scene : scenes) benchmarkScene(scene, runs);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "gl_objects.h"
+
+// the uniforms the scene and deferred lighting programs set by name
+static const char* const NAMES[] = {
+    "sampler_shadow", "sampler_atlas", "sampler_lights", "sampler_clusters", "sampler_cluster_lights", "sampler_arrays",
+    "material_index", "sampler_gbuffer_albedo", "sampler_gbuffer_normal", "sampler_gbuffer_ambient", "sampler_gbuffer_depth",
+    "inverse_view_projection", "no_such_uniform",
+};
+static constexpr UniformName HASHED[] = {
+    "sampler_shadow", "sampler_atlas", "sampler_lights", "sampler_clusters", "sampler_cluster_lights", "sampler_arrays",
+    "material_index", "sampler_gbuffer_albedo", "sampler_gbuffer_normal", "sampler_gbuffer_ambient", "sampler_gbuffer_depth",
+    "inverse_view_projection", "no_such_uniform",
+};
+static const size_t ROUNDS = 1000000;
+
+// keeps the lookups from being optimized out
+static volatile GLint sink;
+
+// ns per lookup over ROUNDS passes of every name
+static double timeLookups(auto lookup) {
+    GLint sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < std::size(NAMES); ++i) sum += lookup(i);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    sink = sum;
+    return elapsed.count() / (ROUNDS * std::size(NAMES));
+}
+
+// Program::location's compile-time hashed open addressing against the string
+// keyed maps a per-call name lookup would use. No context, so
+// glGetUniformLocation itself is not measured; it sits behind a driver call
+// and a string lookup of its own, so the maps are its lower bound.
+int main() {
+    std::vector<std::pair<std::string, GLint>> active;
+    for (size_t i = 0; i + 1 < std::size(NAMES); ++i) active.emplace_back(NAMES[i], GLint(i)); // the last one is dropped
+    active.emplace_back("sampler_arrays[0]", 5);
+
+    Program program{0};
+    program.fillUniforms(active);
+    std::unordered_map<std::string, GLint> hashMap{active.begin(), active.end()};
+    std::map<std::string, GLint> treeMap{active.begin(), active.end()};
+
+    double hashed = timeLookups([&](size_t i) { return program.location(HASHED[i]); });
+    double unordered = timeLookups([&](size_t i) {
+        auto it = hashMap.find(NAMES[i]);
+        return it == hashMap.end() ? -1 : it->second;
+    });
+    double ordered = timeLookups([&](size_t i) {
+        auto it = treeMap.find(NAMES[i]);
+        return it == treeMap.end() ? -1 : it->second;
+    });
+    std::cout << "Program::location: " << hashed << " ns\n";
+    std::cout << "std::unordered_map<std::string>: " << unordered << " ns (" << unordered / hashed << "x)\n";
+    std::cout << "std::map<std::string>: " << ordered << " ns (" << ordered / hashed << "x)\n";
+
+    for (size_t i = 0; i < std::size(NAMES); ++i) {
+        auto it = hashMap.find(NAMES[i]);
+        if (program.location(HASHED[i]) != (it == hashMap.end() ? -1 : it->second)) {
+            std::cerr << "lookups disagree on " << NAMES[i] << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
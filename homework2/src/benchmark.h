@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "camera.h"
+#include "render.h"
+#include "frame_pipeline.h"
+
+// one line of a camera path: "x y z yaw pitch", angles as in Camera::angle
+struct CameraKey {
+    glm::vec3 position;
+    glm::vec2 angle;
+};
+
+// blank lines and lines starting with # are skipped
+static std::vector<CameraKey> loadCameraPath(const std::string& path) {
+    std::ifstream in{path};
+    if (!in) {
+        throw std::runtime_error{"failed to open camera path " + path};
+    }
+    std::vector<CameraKey> keys;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number) {
+        if (line.empty() || line.starts_with("#")) continue;
+        std::istringstream fields{line};
+        CameraKey key;
+        if (!(fields >> key.position.x >> key.position.y >> key.position.z >> key.angle.x >> key.angle.y)) {
+            throw std::runtime_error{path + ":" + std::to_string(number) + ": expected x y z yaw pitch"};
+        }
+        keys.push_back(key);
+    }
+    if (keys.size() < 2) {
+        throw std::runtime_error{path + ": a camera path needs at least two keys"};
+    }
+    return keys;
+}
+
+// Catmull-Rom spline through the keys, t from 0 (first key) to 1 (last key)
+static void placeCamera(Camera& camera, const std::vector<CameraKey>& keys, float t) {
+    float segment = std::clamp(t, 0.0f, 1.0f) * (keys.size() - 1);
+    size_t i = std::min<size_t>(segment, keys.size() - 2);
+    float u = segment - i;
+    auto key = [&](ptrdiff_t j) { return keys[std::clamp<ptrdiff_t>(j, 0, keys.size() - 1)]; };
+    auto spline = [&](auto p0, auto p1, auto p2, auto p3) {
+        return 0.5f * (2.0f * p1 + (p2 - p0) * u + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * u * u + (3.0f * p1 - p0 - 3.0f * p2 + p3) * u * u * u);
+    };
+    auto k0 = key(ptrdiff_t(i) - 1), k1 = key(i), k2 = key(i + 1), k3 = key(i + 2);
+    camera.position = spline(k0.position, k1.position, k2.position, k3.position);
+    camera.angle = spline(k0.angle, k1.angle, k2.angle, k3.angle);
+}
+
+struct Percentiles {
+    double p50 = 0.0, p90 = 0.0, p99 = 0.0;
+};
+
+// nearest rank
+static Percentiles percentiles(std::vector<double> values) {
+    if (values.empty()) return {};
+    std::sort(values.begin(), values.end());
+    auto rank = [&](double p) { return values[std::min<size_t>(std::ceil(p * values.size()), values.size()) - 1]; };
+    return {rank(0.5), rank(0.9), rank(0.99)};
+}
+
+struct BenchmarkOptions {
+    std::string cameraPath;
+    unsigned frames = 600;
+    unsigned warmup = 30; // frames at the start of the path, not measured
+    int width = 1280, height = 720;
+    bool pipelined = false; // through a FramePipeline, each frame draws the one prepared during the previous
+    size_t gpuMemoryBudget = SIZE_MAX; // bytes, checked after the run
+};
+
+// Replays the camera path once over options.frames frames into the bound
+// framebuffer, after every texture is uploaded, and prints the frame
+// statistics to out as one JSON object. Every frame ends with glFinish, so
+// frame_ms is CPU submission plus GPU time, and cpu_ms submission alone.
+// prepare_ms is DrawableScene::prepare wherever it ran; pipelined,
+// prepare_saved_ms is how much of it the GL thread did not wait for.
+// gpu_memory is GpuMemory at the end, which must be within
+// options.gpuMemoryBudget; the statistics are printed either way.
+static void runBenchmark(DrawableScene& scene, const std::vector<Light>& lights, const BenchmarkOptions& options, std::ostream& out) {
+    auto keys = loadCameraPath(options.cameraPath);
+    TextureManager::finish();
+
+    Camera camera;
+    camera.aspectRatio = float(options.width) / float(options.height);
+    glViewport(0, 0, options.width, options.height);
+
+    std::optional<FramePipeline> pipeline;
+    if (options.pipelined) pipeline.emplace(scene, lights);
+    double saved = 0.0;
+
+    auto frame = [&](float t) {
+        TextureManager::update();
+        placeCamera(camera, keys, t);
+        if (pipeline) {
+            const auto& list = pipeline->advance(camera);
+            scene.calculateShadows(list.camera, lights);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            scene.render(list, lights);
+            saved = pipeline->savedMs(list);
+        } else {
+            scene.calculateShadows(camera, lights);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            scene.render(camera, lights);
+        }
+    };
+
+    scene.timePasses = true;
+    for (unsigned i = 0; i < options.warmup; ++i) frame(0.0f);
+    glFinish();
+    for (auto& timer : scene.passTimers) {
+        timer.finish();
+        timer.keepHistory = true;
+        timer.history.clear();
+    }
+
+    std::vector<double> cpuTimes, frameTimes, prepareTimes, savedTimes, drawCalls, triangles;
+    for (unsigned i = 0; i < options.frames; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        frame(options.frames > 1 ? float(i) / (options.frames - 1) : 0.0f);
+        auto submitted = std::chrono::steady_clock::now();
+        glFinish();
+        auto finished = std::chrono::steady_clock::now();
+
+        cpuTimes.push_back(std::chrono::duration<double, std::milli>(submitted - start).count());
+        frameTimes.push_back(std::chrono::duration<double, std::milli>(finished - start).count());
+        prepareTimes.push_back(scene.stats.prepareMs);
+        savedTimes.push_back(saved);
+        drawCalls.push_back(scene.stats.drawCalls + scene.stats.shadowDrawCalls);
+        triangles.push_back(scene.stats.triangles + scene.stats.shadowTriangles);
+    }
+    for (auto& timer : scene.passTimers) timer.finish();
+    scene.timePasses = false;
+
+    auto quote = [](std::string text) {
+        std::string result = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') result += '\\';
+            result += c;
+        }
+        return result + "\"";
+    };
+    auto print = [&](const std::vector<double>& values) {
+        auto p = percentiles(values);
+        out << "{\"p50\": " << p.p50 << ", \"p90\": " << p.p90 << ", \"p99\": " << p.p99 << "}";
+    };
+
+    out << "{\n";
+    out << "  \"renderer\": " << quote((const char*)glGetString(GL_RENDERER)) << ",\n";
+    out << "  \"camera_path\": " << quote(options.cameraPath) << ",\n";
+    out << "  \"frames\": " << options.frames << ",\n";
+    out << "  \"resolution\": [" << options.width << ", " << options.height << "],\n";
+    out << "  \"path\": " << quote(scene.path == RenderPath::Deferred ? "deferred" : "forward") << ",\n";
+    out << "  \"depth_prepass\": " << (scene.depthPrepass ? "true" : "false") << ",\n";
+    out << "  \"occlusion_culling\": " << (scene.occlusionCulling ? "true" : "false") << ",\n";
+    out << "  \"pipelined\": " << (options.pipelined ? "true" : "false") << ",\n";
+    out << "  \"lights\": " << lights.size() << ",\n";
+    out << "  \"cpu_ms\": ";
+    print(cpuTimes);
+    out << ",\n  \"frame_ms\": ";
+    print(frameTimes);
+    out << ",\n  \"prepare_ms\": ";
+    print(prepareTimes);
+    out << ",\n  \"prepare_saved_ms\": ";
+    print(savedTimes);
+    out << ",\n  \"gpu_ms\": {";
+    // a pass that did not run in a frame (shadows that stayed valid) has no sample for it
+    bool first = true;
+    for (size_t i = 0; i < scene.passTimers.size(); ++i) {
+        const auto& history = scene.passTimers[i].history;
+        if (history.empty()) continue;
+        std::vector<double> times;
+        for (auto ns : history) times.push_back(ns * 1e-6);
+        out << (first ? "\n" : ",\n") << "    " << quote(GPU_PASS_NAMES[i]) << ": ";
+        print(times);
+        first = false;
+    }
+    out << "\n  },\n  \"draw_calls\": ";
+    print(drawCalls);
+    out << ",\n  \"triangles\": ";
+    print(triangles);
+    const auto& textures = TextureManager::instance().stats;
+    out << ",\n  \"textures\": {\"resident_bytes\": " << textures.residentBytes << ", \"pending_uploads\": " << textures.pendingUploads
+        << ", \"uploads\": " << textures.uploads << ", \"evictions\": " << textures.evictions << ", \"budget_misses\": " << textures.budgetMisses << "}";
+    const auto& memory = GpuMemory::instance();
+    out << ",\n  \"gpu_memory\": {\"total\": " << memory.total();
+    for (size_t i = 0; i < size_t(GpuCategory::Count); ++i) out << ", " << quote(GPU_CATEGORY_NAMES[i]) << ": " << memory.total(GpuCategory(i));
+    out << "}";
+    out << "\n}" << std::endl;
+    memory.expectWithin(options.gpuMemoryBudget);
+}
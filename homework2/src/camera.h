@@ -8,6 +8,8 @@ struct Camera {
     glm::vec2 angle{0.0f};
     float fov = glm::radians(70.0f);
     float aspectRatio = 1.0f;
+    float zNear = 0.1f;
+    float zFar = 10000.0f;
 
     glm::vec3 direction() const {
         return {
@@ -34,7 +36,7 @@ struct Camera {
     }
 
     glm::mat4 projection() const {
-        return glm::perspective(fov, aspectRatio, 0.1f, 10000.0f);
+        return glm::perspective(fov, aspectRatio, zNear, zFar);
     }
 
     void look(glm::vec2 delta) {
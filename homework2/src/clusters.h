@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "parallel.h"
+
+static const unsigned CLUSTERS_X = 16, CLUSTERS_Y = 9, CLUSTERS_Z = 24;
+static const unsigned CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+
+// world space; an infinite radius reaches every cluster
+struct LightSphere {
+    glm::vec3 center;
+    float radius;
+};
+
+// Froxel grid over the view frustum: CLUSTERS_X x CLUSTERS_Y screen tiles
+// times CLUSTERS_Z depth slices, spaced exponentially between near and far
+// (everything closer than near falls into the first slice). assign() lists
+// the lights reaching every cluster, each list in ascending light order, in
+// one flat index array. Slices are filled in parallel, independently of each
+// other, so the result does not depend on the thread count.
+struct ClusterGrid {
+    float near = 10.0f, far = 10000.0f;
+    float tanX = 1.0f, tanY = 1.0f;      // half extents of the view frustum at unit depth
+    std::vector<uint32_t> ranges;        // (offset, count) into indices for every cluster
+    std::vector<uint32_t> indices;       // light indices, grouped by cluster
+
+    // per light: view space center, depth extent and the slices it spans
+    struct ViewSphere {
+        glm::vec3 center;
+        float radius;
+        unsigned firstSlice, lastSlice;
+    };
+    std::vector<ViewSphere> spheres;
+    std::vector<std::vector<uint32_t>> lists; // by cluster, kept between frames for their capacity
+
+    static unsigned index(unsigned x, unsigned y, unsigned z) {
+        return (z * CLUSTERS_Y + y) * CLUSTERS_X + x;
+    }
+
+    // slices per unit of log depth, as the shader wants it
+    float sliceScale() const {
+        return CLUSTERS_Z / std::log(far / near);
+    }
+
+    unsigned slice(float depth) const {
+        if (depth <= near) return 0;
+        return std::min<unsigned>(std::log(depth / near) * sliceScale(), CLUSTERS_Z - 1);
+    }
+
+    float sliceStart(unsigned z) const {
+        return z == 0 ? 0.0f : near * std::pow(far / near, float(z) / CLUSTERS_Z);
+    }
+
+    void assign(const glm::mat4& view, float fov, float aspectRatio, const std::vector<LightSphere>& lights, ThreadPool& pool) {
+        tanY = std::tan(fov * 0.5f);
+        tanX = tanY * aspectRatio;
+
+        spheres.clear();
+        for (const auto& light : lights) {
+            glm::vec3 center{view * glm::vec4{light.center, 1.0f}};
+            if (std::isinf(light.radius)) {
+                spheres.push_back({center, light.radius, 0, CLUSTERS_Z - 1});
+                continue;
+            }
+            float depth = -center.z;
+            if (depth + light.radius <= 0.0f || depth - light.radius >= far) {
+                spheres.push_back({center, light.radius, 1, 0}); // outside, spans no slice
+                continue;
+            }
+            spheres.push_back({center, light.radius, slice(depth - light.radius), slice(depth + light.radius)});
+        }
+
+        lists.resize(CLUSTER_COUNT);
+        pool.parallelFor(CLUSTERS_Z, [&](size_t z) {
+            assignSlice(z);
+        });
+
+        ranges.resize(CLUSTER_COUNT * 2);
+        indices.clear();
+        for (unsigned i = 0; i < CLUSTER_COUNT; ++i) {
+            ranges[i * 2] = indices.size();
+            ranges[i * 2 + 1] = lists[i].size();
+            indices.insert(indices.end(), lists[i].begin(), lists[i].end());
+        }
+    }
+
+private:
+    void assignSlice(unsigned z) {
+        for (unsigned i = 0; i < CLUSTERS_X * CLUSTERS_Y; ++i) {
+            lists[z * CLUSTERS_X * CLUSTERS_Y + i].clear();
+        }
+
+        float sliceNear = std::max(sliceStart(z), 1e-3f);
+        float sliceFar = z + 1 == CLUSTERS_Z ? far : sliceStart(z + 1);
+        for (uint32_t light = 0; light < spheres.size(); ++light) {
+            const auto& sphere = spheres[light];
+            if (z < sphere.firstSlice || z > sphere.lastSlice) continue;
+
+            unsigned x0 = 0, x1 = CLUSTERS_X - 1, y0 = 0, y1 = CLUSTERS_Y - 1;
+            if (!std::isinf(sphere.radius)) {
+                // bounding box of the sphere, clipped to the slab of this slice, projected conservatively
+                float depth = -sphere.center.z;
+                float a = std::max(sliceNear, depth - sphere.radius), b = std::min(sliceFar, depth + sphere.radius);
+                auto extent = [&](float lo, float hi, float tangent, unsigned tiles, unsigned& first, unsigned& last) {
+                    float ndcLo = lo / ((lo < 0.0f ? a : b) * tangent);
+                    float ndcHi = hi / ((hi > 0.0f ? a : b) * tangent);
+                    if (ndcLo > 1.0f || ndcHi < -1.0f) return false;
+                    first = std::clamp(int(std::floor((ndcLo * 0.5f + 0.5f) * tiles)), 0, int(tiles) - 1);
+                    last = std::clamp(int(std::floor((ndcHi * 0.5f + 0.5f) * tiles)), 0, int(tiles) - 1);
+                    return true;
+                };
+                if (!extent(sphere.center.x - sphere.radius, sphere.center.x + sphere.radius, tanX, CLUSTERS_X, x0, x1)) continue;
+                if (!extent(sphere.center.y - sphere.radius, sphere.center.y + sphere.radius, tanY, CLUSTERS_Y, y0, y1)) continue;
+            }
+
+            for (unsigned y = y0; y <= y1; ++y) {
+                for (unsigned x = x0; x <= x1; ++x) {
+                    lists[index(x, y, z)].push_back(light);
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <glm/glm.hpp>
+#include "occlusion.h"
+
+// view volume as six inward-facing planes (xyz = normal, w = distance),
+// extracted from a projection * view matrix
+struct Frustum {
+    std::array<glm::vec4, 6> planes;
+
+    static Frustum fromMatrix(const glm::mat4& m) {
+        Frustum result;
+        auto row = [&](int i) { return glm::vec4{m[0][i], m[1][i], m[2][i], m[3][i]}; };
+        result.planes = {
+            row(3) + row(0), row(3) - row(0),
+            row(3) + row(1), row(3) - row(1),
+            row(3) + row(2), row(3) - row(2),
+        };
+        for (auto& plane : result.planes) {
+            plane /= glm::length(glm::vec3{plane});
+        }
+        return result;
+    }
+
+    bool intersectsSphere(glm::vec3 center, float radius) const {
+        for (const auto& plane : planes) {
+            if (glm::dot(glm::vec3{plane}, center) + plane.w < -radius) return false;
+        }
+        return true;
+    }
+
+    bool intersectsBox(glm::vec3 lo, glm::vec3 hi) const {
+        for (const auto& plane : planes) {
+            glm::vec3 far{plane.x > 0.0f ? hi.x : lo.x, plane.y > 0.0f ? hi.y : lo.y, plane.z > 0.0f ? hi.z : lo.z};
+            if (glm::dot(glm::vec3{plane}, far) + plane.w < 0.0f) return false;
+        }
+        return true;
+    }
+};
+
+// Normal cone of a group of triangles: every face normal is within the angle
+// (cosAngle, sinAngle) of axis. cosAngle <= 0 means the group faces all ways and is never culled.
+struct NormalCone {
+    glm::vec3 axis{0.0f, 0.0f, 1.0f};
+    float cosAngle = -1.0f;
+    float sinAngle = 0.0f;
+
+    // every triangle inside the sphere faces away from a perspective eye
+    bool backfacing(glm::vec3 center, float radius, glm::vec3 eye) const {
+        if (cosAngle <= 0.0f) return false;
+        auto d = center - eye;
+        float len = glm::length(d);
+        if (len <= radius) return false;
+        // angle between axis and d, widened by the cone, must stay under 90 degrees with margin
+        float c = glm::dot(d, axis) / len;
+        float s = glm::sqrt(glm::max(0.0f, 1.0f - c * c));
+        return len * (c * cosAngle - s * sinAngle) >= radius;
+    }
+
+    // every triangle faces away from an orthographic view looking along direction
+    bool backfacing(glm::vec3 direction) const {
+        if (cosAngle <= 0.0f) return false;
+        float c = glm::dot(glm::normalize(direction), axis);
+        float s = glm::sqrt(glm::max(0.0f, 1.0f - c * c));
+        return c * cosAngle - s * sinAngle > 0.0f;
+    }
+};
+
+// what a pass is drawn from, for culling
+struct CullView {
+    Frustum frustum;
+    glm::vec3 eye{0.0f};       // perspective views
+    glm::vec3 direction{0.0f}; // orthographic views, from the eye into the scene
+    bool orthographic = false;
+    const OcclusionBuffer* occlusion = nullptr; // rendered from the same view, optional
+
+    static CullView perspective(const glm::mat4& viewProjection, glm::vec3 eye, const OcclusionBuffer* occlusion = nullptr) {
+        return {Frustum::fromMatrix(viewProjection), eye, {}, false, occlusion};
+    }
+
+    static CullView ortho(const glm::mat4& viewProjection, glm::vec3 direction) {
+        return {Frustum::fromMatrix(viewProjection), {}, direction, true};
+    }
+
+    bool visible(glm::vec3 center, float radius, const NormalCone& cone) const {
+        if (!frustum.intersectsSphere(center, radius)) return false;
+        if (orthographic ? cone.backfacing(direction) : cone.backfacing(center, radius, eye)) return false;
+        return !occlusion || !occlusion->occludedSphere(center, radius);
+    }
+
+    // the whole bounding sphere of an object is hidden
+    bool occluded(glm::vec3 center, float radius) const {
+        return occlusion && frustum.intersectsSphere(center, radius) && occlusion->occludedSphere(center, radius);
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <glad/glad.h>
+#include "gl_objects.h"
+
+// layout fixed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Index ranges of one pass into the shared scene buffers, in draw order.
+// Ranges are appended while culling; nothing here touches GL, so a list can
+// be built on any thread.
+struct CommandList {
+    std::vector<DrawElementsIndirectCommand> commands;
+
+    void clear() {
+        commands.clear();
+    }
+
+    size_t size() const {
+        return commands.size();
+    }
+
+    // merges with the previous range when it continues it; objects never merge, their base vertices differ
+    void add(GLuint firstIndex, GLuint count, GLint baseVertex) {
+        if (!commands.empty()) {
+            auto& last = commands.back();
+            if (last.baseVertex == baseVertex && last.firstIndex + last.count == firstIndex) {
+                last.count += count;
+                return;
+            }
+        }
+        commands.push_back({count, 1, firstIndex, baseVertex, 0});
+    }
+
+    size_t indexCount(size_t first, size_t count) const {
+        size_t result = 0;
+        for (size_t i = first; i < first + count; ++i) result += commands[i].count;
+        return result;
+    }
+};
+
+// A CommandList uploaded once on the GL thread, then drawn in slices; a
+// slice is a single glMultiDrawElementsIndirect on GL 4.3 and a single
+// glMultiDrawElementsBaseVertex otherwise.
+struct DrawCommands : CommandList {
+    Buffer buffer;
+    bool indirect = false;
+
+    // glMultiDrawElementsBaseVertex arguments, filled by upload() when !indirect
+    std::vector<GLsizei> counts;
+    std::vector<const void*> offsets;
+    std::vector<GLint> baseVertices;
+
+    void upload(const CommandList& list) {
+        commands = list.commands;
+        if (indirect) {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+            buffer.allocate(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(commands[0]), commands.data(), GL_STREAM_DRAW);
+            return;
+        }
+
+        counts.clear();
+        offsets.clear();
+        baseVertices.clear();
+        for (const auto& command : commands) {
+            counts.push_back(command.count);
+            offsets.push_back((const void*)(command.firstIndex * sizeof(GLuint)));
+            baseVertices.push_back(command.baseVertex);
+        }
+    }
+
+    // commands [first, first + count), with the scene VAO bound
+    void draw(size_t first, size_t count) const {
+        if (count == 0) return;
+        if (indirect) {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void*)(first * sizeof(DrawElementsIndirectCommand)), count, 0);
+        } else {
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts.data() + first, GL_UNSIGNED_INT, offsets.data() + first, count, baseVertices.data() + first);
+        }
+    }
+};
+
+// the culled objects of one pass, ordered by their DrawKey
+struct DrawList {
+    struct Item {
+        uint64_t key;
+        size_t object;
+        size_t firstRange, rangeCount;             // in ranges
+        size_t firstCommand = 0, commandCount = 0; // in commands
+    };
+
+    std::vector<Item> items;
+    std::vector<std::pair<GLuint, GLuint>> ranges; // (first index, count) within the object, that survived the cull
+    CommandList commands;
+    size_t objectsOccluded = 0;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+#include "camera.h"
+#include "parallel.h"
+#include "render.h"
+
+// Two-stage frames: a worker runs DrawableScene::prepare for frame N + 1
+// while the GL thread draws frame N, so the submission thread only uploads
+// and draws. Costs a frame of latency. The scene's settings are copied into
+// the list on the GL thread, so toggling them never races the worker; the
+// lights must not change while the pipeline lives.
+struct FramePipeline {
+    const DrawableScene& scene;
+    const std::vector<Light>& lights;
+    double waitMs = 0.0; // the GL thread spent waiting for the last prepared frame
+
+    FramePipeline(const DrawableScene& scene, const std::vector<Light>& lights) : scene{scene}, lights{lights} {}
+
+    FramePipeline(const FramePipeline& that) = delete;
+    FramePipeline& operator=(const FramePipeline& that) = delete;
+
+    ~FramePipeline() {
+        if (preparing.valid()) preparing.wait();
+    }
+
+    // Waits for the frame the previous call started, starts preparing the one
+    // seen from camera and returns the former to draw. The first call
+    // prepares its frame in place, so there always is one.
+    const RenderList& advance(const Camera& camera) {
+        auto start = std::chrono::steady_clock::now();
+        if (preparing.valid()) {
+            preparing.get();
+        } else {
+            scene.prepare(camera, lights, scene.configure(lists[next]));
+        }
+        waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        const auto& ready = lists[next];
+        next ^= 1;
+        auto task = std::make_shared<std::packaged_task<void()>>([this, camera, &list = scene.configure(lists[next])] { scene.prepare(camera, lights, list); });
+        preparing = task->get_future();
+        worker.submit([task] { (*task)(); });
+        return ready;
+    }
+
+    // of the returned frame, moved off the GL thread; the first frame saves nothing
+    double savedMs(const RenderList& list) const {
+        return std::max(list.prepareMs - waitMs, 0.0);
+    }
+
+private:
+    std::array<RenderList, 2> lists;
+    size_t next = 0; // the list the next advance() returns
+    std::future<void> preparing;
+    ThreadPool worker{1}; // last, so it is joined before the lists go
+};
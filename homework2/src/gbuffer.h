@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdexcept>
+#include <glad/glad.h>
+#include "gl_objects.h"
+
+// Render targets of the deferred path, 16 bytes per pixel:
+//   albedo  SRGB8_ALPHA8  Kd, Ks
+//   normal  RGB10_A2      octahedral normal, log-encoded Ns
+//   ambient SRGB8_ALPHA8  Ka
+//   depth   DEPTH24
+struct GBuffer {
+    Framebuffer framebuffer;
+    Texture albedo, normal, ambient, depth;
+    int width = 0, height = 0;
+
+    // reallocates the targets when the viewport size changed
+    void resize(int w, int h) {
+        if (w == width && h == height) return;
+        width = w;
+        height = h;
+
+        auto allocate = [&](const Texture& texture, const char* name, GLenum internalFormat, GLenum format, GLenum type) {
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            texture.label(GpuCategory::RenderTargets, name);
+            texture.allocated(size_t(width) * height * texelBytes(internalFormat));
+        };
+        allocate(albedo, "G-buffer albedo", GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        allocate(normal, "G-buffer normal", GL_RGB10_A2, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV);
+        allocate(ambient, "G-buffer ambient", GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        allocate(depth, "G-buffer depth", GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, ambient, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+        GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, buffers);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            throw std::runtime_error{"G-buffer framebuffer incomplete"};
+        }
+    }
+};
@@ -1,12 +1,130 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <unordered_map>
+#include <vector>
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
+// what a GPU allocation is for, in GpuMemory reports
+enum class GpuCategory {
+    Geometry,
+    Uniforms,
+    Commands,
+    Materials,
+    Shadows,
+    Lights,
+    RenderTargets,
+    Other,
+    Count,
+};
+
+static const char* const GPU_CATEGORY_NAMES[] = {"geometry", "uniforms", "commands", "materials", "shadows", "lights", "render_targets", "other"};
+
+// Bytes behind every live Buffer and Texture, by GL name, as their upload
+// paths size them: a buffer by what glBufferData was given, a texture by its
+// levels and layers at the format's size. What the driver adds on top
+// (alignment, padding, compression) is not seen. Buffers and textures that
+// were never labelled count as Other; those never allocated count nothing.
+// GL thread only.
+struct GpuMemory {
+    struct Resource {
+        GpuCategory category = GpuCategory::Other;
+        std::string label;
+        size_t bytes = 0;
+    };
+
+    std::unordered_map<uint64_t, Resource> resources; // by GL object type << 32 | name
+
+    static GpuMemory& instance() {
+        static GpuMemory singleton;
+        return singleton;
+    }
+
+    void label(GLenum type, GLuint id, GpuCategory category, std::string name) {
+        auto& resource = resources[key(type, id)];
+        resource.category = category;
+        resource.label = std::move(name);
+    }
+
+    void resize(GLenum type, GLuint id, size_t bytes) {
+        resources[key(type, id)].bytes = bytes;
+    }
+
+    void forget(GLenum type, GLuint id) {
+        resources.erase(key(type, id));
+    }
+
+    size_t total() const {
+        size_t result = 0;
+        for (const auto& [_, resource] : resources) result += resource.bytes;
+        return result;
+    }
+
+    size_t total(GpuCategory category) const {
+        size_t result = 0;
+        for (const auto& [_, resource] : resources) {
+            if (resource.category == category) result += resource.bytes;
+        }
+        return result;
+    }
+
+    // the totals by category, then every resource, largest first
+    void dump(std::ostream& out) const {
+        auto mib = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+        out << "GPU memory " << mib(total()) << " MiB in " << resources.size() << " resources\n";
+        for (size_t i = 0; i < size_t(GpuCategory::Count); ++i) {
+            size_t bytes = total(GpuCategory(i));
+            if (bytes > 0) out << "  " << GPU_CATEGORY_NAMES[i] << " " << mib(bytes) << " MiB\n";
+        }
+        std::vector<const Resource*> sorted;
+        for (const auto& [_, resource] : resources) sorted.push_back(&resource);
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->bytes > b->bytes; });
+        for (const auto* resource : sorted) {
+            out << "    " << mib(resource->bytes) << " MiB " << GPU_CATEGORY_NAMES[size_t(resource->category)] << " "
+                << (resource->label.empty() ? "(unlabelled)" : resource->label) << "\n";
+        }
+    }
+
+    // throws when everything together, or the category alone, takes more than budget bytes
+    void expectWithin(size_t budget) const {
+        if (total() > budget) {
+            throw std::runtime_error{"GPU memory over budget: " + std::to_string(total()) + " > " + std::to_string(budget) + " bytes"};
+        }
+    }
+
+    void expectWithin(GpuCategory category, size_t budget) const {
+        if (total(category) > budget) {
+            throw std::runtime_error{std::string{"GPU memory over budget in "} + GPU_CATEGORY_NAMES[size_t(category)] + ": "
+                                     + std::to_string(total(category)) + " > " + std::to_string(budget) + " bytes"};
+        }
+    }
+
+private:
+    static uint64_t key(GLenum type, GLuint id) {
+        return uint64_t(type) << 32 | id;
+    }
+};
+
+// bytes per texel of the uncompressed internal formats the renderer allocates
+static size_t texelBytes(GLenum internalFormat) {
+    switch (internalFormat) {
+    case GL_RGBA8:
+    case GL_SRGB8_ALPHA8:
+    case GL_RGB10_A2:
+    case GL_DEPTH_COMPONENT24: // padded to 32 bits in practice
+        return 4;
+    default:
+        throw std::runtime_error{"texelBytes: unknown internal format"};
+    }
+}
+
 template <typename Impl>
 struct GLObject {
     GLuint Id = 0;
@@ -42,8 +160,20 @@ struct Buffer : GLObject<Buffer> {
     }
 
     static void Delete(GLuint id) {
+        GpuMemory::instance().forget(GL_BUFFER, id);
         glDeleteBuffers(1, &id);
     }
+
+    // names the buffer in GpuMemory reports
+    void label(GpuCategory category, std::string name) const {
+        GpuMemory::instance().label(GL_BUFFER, Id, category, std::move(name));
+    }
+
+    // glBufferData on target, which this buffer must be bound to
+    void allocate(GLenum target, size_t bytes, const void* data, GLenum usage) const {
+        glBufferData(target, bytes, data, usage);
+        GpuMemory::instance().resize(GL_BUFFER, Id, bytes);
+    }
 };
 
 struct Framebuffer : GLObject<Framebuffer> {
@@ -66,12 +196,75 @@ struct Texture : GLObject<Texture> {
     }
 
     static void Delete(GLuint id) {
+        GpuMemory::instance().forget(GL_TEXTURE, id);
         glDeleteTextures(1, &id);
     }
+
+    // names the texture in GpuMemory reports
+    void label(GpuCategory category, std::string name) const {
+        GpuMemory::instance().label(GL_TEXTURE, Id, category, std::move(name));
+    }
+
+    // records the size of the storage its glTexImage* calls just allocated, all levels and layers
+    void allocated(size_t bytes) const {
+        GpuMemory::instance().resize(GL_TEXTURE, Id, bytes);
+    }
+};
+
+struct Query : GLObject<Query> {
+    static GLuint New() {
+        GLuint id;
+        glGenQueries(1, &id);
+        return id;
+    }
+
+    static void Delete(GLuint id) {
+        glDeleteQueries(1, &id);
+    }
+};
+
+// a buffer that shaders read through a samplerBuffer; the memory is the buffer's
+struct TextureBuffer {
+    Buffer buffer;
+    Texture texture;
+
+    // respecifies the whole buffer; the texture keeps pointing at it
+    void upload(GLenum format, const void* data, size_t bytes) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        buffer.allocate(GL_TEXTURE_BUFFER, bytes, data, GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+};
+
+// FNV-1a, usable in constant expressions
+static constexpr uint32_t fnv1a(std::string_view s) {
+    uint32_t hash = 2166136261u;
+    for (char c : s) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    return hash;
+}
+
+// A uniform name hashed at compile time; string literals convert to it implicitly.
+struct UniformName {
+    uint32_t hash;
+
+    consteval UniformName(const char* name) : hash(fnv1a(name)) {}
 };
 
 struct Program : GLObject<Program> {
-    mutable std::unordered_map<std::string, GLint> locations;
+    struct UniformSlot {
+        uint32_t hash = 0; // 0 marks an empty slot
+        GLint location = -1;
+    };
+
+    // open addressing by name hash, filled from glGetActiveUniform after linking
+    std::vector<UniformSlot> uniforms;
+
+    using GLObject::GLObject; // Program{0} is only a uniform table, for fillUniforms without GL
 
     static GLuint New() {
         return glCreateProgram();
@@ -81,15 +274,57 @@ struct Program : GLObject<Program> {
         glDeleteProgram(id);
     }
 
-    void setUniform(const std::string& name, auto value) const {
-        GLint location;
-        auto it = locations.find(name);
-        if (it == locations.end()) {
-            location = glGetUniformLocation(Id, name.c_str());
-            locations.emplace(name, location);
-        } else {
-            location = it->second;
+    void resolveUniforms() {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(Id, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(Id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+        std::vector<std::pair<std::string, GLint>> active;
+        std::string name(maxLength, '\0');
+        for (GLint i = 0; i < count; ++i) {
+            GLsizei length;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(Id, i, name.size(), &length, &size, &type, name.data());
+            std::string current = name.substr(0, length);
+            GLint location = glGetUniformLocation(Id, current.c_str());
+            if (location < 0) continue; // uniform block member
+            // arrays are reported as "name[0]" but may be set by their bare name too
+            if (current.ends_with("[0]")) active.emplace_back(current.substr(0, current.size() - 3), location);
+            active.emplace_back(std::move(current), location);
+        }
+        fillUniforms(active);
+    }
+
+    // the lookup table behind location(), from (name, location) pairs; no GL
+    void fillUniforms(const std::vector<std::pair<std::string, GLint>>& active) {
+        size_t capacity = 1;
+        while (capacity < 2 * active.size()) capacity *= 2;
+        uniforms.assign(capacity, {});
+        for (const auto& [current, location] : active) {
+            uint32_t hash = fnv1a(current);
+            if (hash == 0) throw std::runtime_error{"uniform hashes to zero: " + current};
+            size_t i = hash & (capacity - 1);
+            while (uniforms[i].hash != 0) {
+                if (uniforms[i].hash == hash) throw std::runtime_error{"uniform hash collision: " + current};
+                i = (i + 1) & (capacity - 1);
+            }
+            uniforms[i] = {hash, location};
+        }
+    }
+
+    // -1, like glGetUniformLocation, for names the linker dropped
+    GLint location(UniformName name) const {
+        if (uniforms.empty()) return -1;
+        size_t mask = uniforms.size() - 1;
+        for (size_t i = name.hash & mask; uniforms[i].hash != 0; i = (i + 1) & mask) {
+            if (uniforms[i].hash == name.hash) return uniforms[i].location;
         }
+        return -1;
+    }
+
+    void setUniform(UniformName name, auto value) const {
+        GLint location = this->location(name);
 
         using type = std::decay_t<decltype(value)>;
 
@@ -107,8 +342,27 @@ struct Program : GLObject<Program> {
             static_assert(std::is_same_v<type, void>, "setUniform: Not implemented");
         }
     }
+
+    // no-op if the block was optimized out
+    void bindUniformBlock(const char* name, GLuint binding) const {
+        GLuint index = glGetUniformBlockIndex(Id, name);
+        if (index != GL_INVALID_INDEX) {
+            glUniformBlockBinding(Id, index, binding);
+        }
+    }
 };
 
+// inserts a "#define NAME" line for every entry right after the #version directive
+static std::string withDefines(const std::string& source, const std::vector<std::string>& defines) {
+    auto pos = source.find("#version");
+    pos = pos == std::string::npos ? 0 : source.find('\n', pos) + 1;
+    std::string header;
+    for (const auto& define : defines) {
+        header += "#define " + define + "\n";
+    }
+    return source.substr(0, pos) + header + source.substr(pos);
+}
+
 static GLuint createShader(GLenum type, const char * source) {
     GLuint result = glCreateShader(type);
     glShaderSource(result, 1, &source, nullptr);
@@ -125,6 +379,10 @@ static GLuint createShader(GLenum type, const char * source) {
     return result;
 }
 
+static GLuint createShader(GLenum type, const std::string& source) {
+    return createShader(type, source.c_str());
+}
+
 static Program createProgram(GLuint vs, GLuint fs) {
     Program result;
     glAttachShader(result, vs);
@@ -144,5 +402,6 @@ static Program createProgram(GLuint vs, GLuint fs) {
     glDeleteShader(vs);
     glDeleteShader(fs);
 
+    result.resolveUniforms();
     return result;
 }
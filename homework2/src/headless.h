@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdexcept>
+#include <glad/glad.h>
+#include "gl_objects.h"
+
+#ifdef HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// A GL 3.3 core context with no window and no display server: EGL on Mesa's
+// surfaceless platform, which llvmpipe supports too. Nothing is bound to
+// draw into, see OffscreenTarget. Must outlive every GL object.
+struct HeadlessContext {
+#ifdef HAS_EGL
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+
+    HeadlessContext() {
+        auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (!getPlatformDisplay) {
+            throw std::runtime_error{"eglGetPlatformDisplayEXT is not supported"};
+        }
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+            throw std::runtime_error{"surfaceless EGL display is not available"};
+        }
+        eglBindAPI(EGL_OPENGL_API);
+
+        const EGLint attributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE,
+        };
+        context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+        if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            eglTerminate(display);
+            throw std::runtime_error{"eglCreateContext failed"};
+        }
+
+        if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+            throw std::runtime_error{"gladLoadGLLoader failed"};
+        }
+    }
+
+    ~HeadlessContext() {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
+#else
+    HeadlessContext() {
+        throw std::runtime_error{"built without EGL, no headless context"};
+    }
+#endif
+
+    HeadlessContext(const HeadlessContext&) = delete;
+    HeadlessContext& operator=(const HeadlessContext&) = delete;
+};
+
+// stands in for the default framebuffer of a window, bound on construction
+struct OffscreenTarget {
+    Framebuffer framebuffer;
+    Texture color, depth;
+
+    OffscreenTarget(int width, int height) {
+        glBindTexture(GL_TEXTURE_2D, color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        color.label(GpuCategory::RenderTargets, "offscreen color");
+        color.allocated(size_t(width) * height * texelBytes(GL_SRGB8_ALPHA8));
+        depth.label(GpuCategory::RenderTargets, "offscreen depth");
+        depth.allocated(size_t(width) * height * texelBytes(GL_DEPTH_COMPONENT24));
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            throw std::runtime_error{"offscreen framebuffer incomplete"};
+        }
+        glViewport(0, 0, width, height);
+    }
+};
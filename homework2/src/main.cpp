@@ -1,16 +1,28 @@
 #include <array>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <unordered_map>
 #include <vector>
-#include <fstream>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
 
 #include "gl_objects.h"
 #include "shaders.h"
 #include "camera.h"
 #include "scene.h"
+#include "mapped_file.h"
+#include "scene_cache.h"
+#include "mesh_optimize.h"
+#include "meshlets.h"
 #include "render.h"
+#include "headless.h"
+#include "benchmark.h"
+#include "frame_pipeline.h"
 
 #include <GLFW/glfw3.h>
 #include <glm/ext.hpp>
@@ -55,32 +67,71 @@ void initialize() {
     glDebugMessageCallback(MessageCallback, 0);
 }
 
-void loop() {
+struct Options {
+    unsigned extraLights = 0;
+    RenderPath path = RenderPath::Forward;
+    bool prepass = false, occlusion = false;
+    size_t textureBudget = SIZE_MAX; // bytes
+    bool pipeline = false;           // prepare the next frame on a worker, see FramePipeline
+    bool benchmark = false;
+    BenchmarkOptions benchmarkOptions;
+};
+
+void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--lights N] [--deferred] [--prepass] [--occlusion] [--pipeline] [--texture-budget MiB]\n"
+              << "       [--benchmark camera.path [--frames N] [--resolution W H] [--gpu-memory-budget MiB]]\n";
+}
+
+void setupState() {
     glClearColor(0.53f, 0.81f, 0.92f, 1.0f);
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
     glEnable(GL_BLEND);
     glEnable(GL_FRAMEBUFFER_SRGB);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
 
-    Camera camera;
+DrawableScene loadScene(const Options& options) {
+    auto loadStart = std::chrono::steady_clock::now();
+    TextureManager::instance().budget = options.textureBudget;
     auto scene = [] {
-        std::ifstream mtlIn{"./sponza/sponza.mtl"};
-        auto materials = loadMTL(mtlIn);
-        std::ifstream objIn{"./sponza/sponza.obj"};
-        auto scene = loadOBJ(objIn, materials);
+        std::string objPath = "./sponza/sponza.obj", mtlPath = "./sponza/sponza.mtl", cachePath = "./sponza/sponza.cache";
+        auto objStamp = SourceStamp::of(objPath), mtlStamp = SourceStamp::of(mtlPath);
         DrawableScene result;
+
+        if (auto cooked = loadSceneCache(cachePath, objStamp, mtlStamp)) {
+            result.init(*cooked);
+            return result;
+        }
+
+        MappedFile mtlIn{mtlPath};
+        auto materials = loadMTL(mtlIn.view());
+        MappedFile objIn{objPath};
+        auto scene = loadOBJ(objIn.view(), materials, workerCount());
+        size_t vertexCount = 0;
+        for (const auto& [_, obj] : scene.objects) vertexCount += obj.vertices.size();
+        std::cerr << "Welded " << scene.cornerCount << " corners into " << vertexCount << " vertices ("
+                  << scene.cornerCount * sizeof(VertexData) / 1024 << " KiB -> "
+                  << vertexCount * sizeof(VertexData) / 1024 << " KiB of vertex data)\n";
+        auto cacheStats = optimizeScene(scene, workerCount());
+        std::cerr << "Vertex cache: ACMR " << cacheStats.before.acmr() << " -> " << cacheStats.after.acmr()
+                  << ", ATVR " << cacheStats.before.atvr() << " -> " << cacheStats.after.atvr() << "\n";
+        buildSceneMeshlets(scene, workerCount());
+        if (!writeSceneCache(cachePath, scene, objStamp, mtlStamp)) {
+            std::cerr << "Failed to write " << cachePath << "\n";
+        }
         result.init(scene);
         return result;
     }();
-    std::cerr << "Loaded scene\n";
-
-    int width = 800, height = 600;
-    double xpos = 0.0, ypos = 0.0;
-    float lastTime = 0.0;
-
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    scene.path = options.path;
+    scene.depthPrepass = options.prepass;
+    scene.occlusionCulling = options.occlusion;
+    std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+    std::cerr << "Loaded scene in " << loadTime.count() << " ms, decoding " << TextureManager::pending() << " textures\n";
+    return scene;
+}
 
+std::vector<Light> sceneLights(const DrawableScene& scene, unsigned extraLights) {
     glm::vec3 attenuation{1.0, 0.002, 0.00002};
 
     std::vector<Light> lights;
@@ -124,7 +175,37 @@ void loop() {
         .directional = false
     });
 
-    scene.calculateShadows(lights[0]);
+    // small colored lights scattered over the scene, to load the clustered light loop
+    std::mt19937 random{1};
+    std::uniform_real_distribution<float> unit{0.0f, 1.0f};
+    for (unsigned i = 0; i < extraLights; ++i) {
+        glm::vec3 color{unit(random), unit(random), unit(random)};
+        lights.push_back(Light {
+            .position = scene.bounds.offset + scene.bounds.scale * glm::vec3{unit(random), unit(random), unit(random)},
+            .diffuse = color,
+            .specular = color,
+            .attenuation = glm::vec3(1.0, 0.02, 0.005),
+            .directional = false
+        });
+    }
+    return lights;
+}
+
+void loop(const Options& options) {
+    setupState();
+    auto loadStart = std::chrono::steady_clock::now();
+    auto scene = loadScene(options);
+    auto lights = sceneLights(scene, options.extraLights);
+    Camera camera;
+    bool recordHeld = false, dumpHeld = false;
+    std::optional<FramePipeline> pipeline;
+    if (options.pipeline) pipeline.emplace(scene, lights);
+
+    int width = 800, height = 600;
+    double xpos = 0.0, ypos = 0.0;
+    float lastTime = 0.0;
+
+    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
     while (!glfwWindowShouldClose(window)) {
         glBindVertexArray(0);
@@ -146,22 +227,140 @@ void loop() {
         if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) { camera.move({0, -speed}); }
         if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) { camera.move({-speed, 0}); }
         if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) { camera.move({speed, 0}); }
+        if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) { scene.path = RenderPath::Forward; }
+        if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS) { scene.path = RenderPath::Deferred; }
+        if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS) { scene.depthPrepass = true; }
+        if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS) { scene.depthPrepass = false; }
+        if (glfwGetKey(window, GLFW_KEY_5) == GLFW_PRESS) { scene.occlusionCulling = true; }
+        if (glfwGetKey(window, GLFW_KEY_6) == GLFW_PRESS) { scene.occlusionCulling = false; }
+
+        // C prints the camera as a line of a --benchmark camera path
+        bool recordPressed = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+        if (recordPressed && !recordHeld) {
+            std::cout << camera.position.x << " " << camera.position.y << " " << camera.position.z << " "
+                      << camera.angle.x << " " << camera.angle.y << std::endl;
+        }
+        recordHeld = recordPressed;
+
+        // M lists what is in GPU memory
+        bool dumpPressed = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+        if (dumpPressed && !dumpHeld) GpuMemory::instance().dump(std::cerr);
+        dumpHeld = dumpPressed;
         
+        // mip tails until every texture has one, streaming after that
+        bool loading = TextureManager::pending() > 0;
+        TextureManager::update();
+        if (loading && TextureManager::pending() == 0) {
+            std::chrono::duration<double, std::milli> readyTime = std::chrono::steady_clock::now() - loadStart;
+            std::cerr << "Textures ready in " << readyTime.count() << " ms, " << TextureManager::instance().arrays.size() << " texture arrays\n";
+        }
+
+        // pipelined, the GL thread draws the frame prepared during the previous one
+        const auto* list = pipeline ? &pipeline->advance(camera) : nullptr;
+        scene.calculateShadows(list ? list->camera : camera, lights);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        scene.render(camera, lights);
+        if (list) {
+            scene.render(*list, lights);
+        } else {
+            scene.render(camera, lights);
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS) {
+            const auto& stats = scene.stats;
+            std::cerr << "binds " << stats.bindsIssued << " issued, " << stats.bindsSkipped << " skipped; "
+                      << "uniforms " << stats.uniformsIssued << " issued, " << stats.uniformsSkipped << " skipped\n";
+            if (scene.path == RenderPath::Forward) {
+                std::cerr << "opaque samples shaded " << stats.samplesShaded;
+                if (scene.depthPrepass) std::cerr << ", pre-pass samples " << stats.samplesPrepass;
+                std::cerr << "\n";
+            }
+            std::cerr << "prepared in " << stats.prepareMs << " ms";
+            if (list) std::cerr << ", " << pipeline->savedMs(*list) << " ms of it off the GL thread";
+            std::cerr << "\n";
+            if (scene.occlusionCulling) {
+                std::cerr << "occluded " << stats.objectsOccluded << " objects, " << stats.meshletsOccluded << " meshlets\n";
+            }
+            const auto& textures = TextureManager::instance().stats;
+            std::cerr << "textures " << textures.residentBytes / (1024 * 1024) << " MiB resident, " << textures.pendingUploads << " pending, "
+                      << textures.uploads << " streamed, " << textures.evictions << " evicted, " << textures.budgetMisses << " budget misses\n";
+            const auto& atlas = scene.shadowAtlas.stats;
+            std::cerr << "shadow atlas " << atlas.shadowedLights << " lights (" << atlas.droppedLights << " dropped), "
+                      << atlas.tiles << " tiles, " << atlas.tilesRendered << " redrawn, "
+                      << 100.0 * atlas.texelsUsed / atlas.texelsTotal << "% used\n";
+        }
 
         glfwPollEvents();
         glfwSwapBuffers(window);
     }
 
-    TextureManager::instance().textures.clear();
+    TextureManager::instance().arrays.clear();
 }
 
-int main() {
+// no window: renders options.benchmarkOptions.cameraPath offscreen and prints the statistics to stdout
+void benchmark(const Options& options) {
+    auto benchmarkOptions = options.benchmarkOptions;
+    benchmarkOptions.pipelined = options.pipeline;
+    HeadlessContext context;
+    OffscreenTarget target{benchmarkOptions.width, benchmarkOptions.height};
+    setupState();
+    {
+        auto scene = loadScene(options);
+        auto lights = sceneLights(scene, options.extraLights);
+        runBenchmark(scene, lights, benchmarkOptions, std::cout);
+    }
+    TextureManager::instance().arrays.clear();
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+                options.extraLights = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--deferred") == 0) {
+                options.path = RenderPath::Deferred;
+            } else if (std::strcmp(argv[i], "--prepass") == 0) {
+                options.prepass = true;
+            } else if (std::strcmp(argv[i], "--occlusion") == 0) {
+                options.occlusion = true;
+            } else if (std::strcmp(argv[i], "--pipeline") == 0) {
+                options.pipeline = true;
+            } else if (std::strcmp(argv[i], "--texture-budget") == 0 && i + 1 < argc) {
+                options.textureBudget = std::stoull(argv[++i]) * 1024 * 1024;
+            } else if (std::strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+                options.benchmark = true;
+                options.benchmarkOptions.cameraPath = argv[++i];
+            } else if (std::strcmp(argv[i], "--gpu-memory-budget") == 0 && i + 1 < argc) {
+                options.benchmarkOptions.gpuMemoryBudget = std::stoull(argv[++i]) * 1024 * 1024;
+            } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                options.benchmarkOptions.frames = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--resolution") == 0 && i + 2 < argc) {
+                options.benchmarkOptions.width = std::stoi(argv[++i]);
+                options.benchmarkOptions.height = std::stoi(argv[++i]);
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::logic_error&) { // a value that is not a number
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (options.benchmark) {
+        try {
+            benchmark(options);
+        } catch (const std::exception& e) { // over the GPU memory budget, or no context
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
     try {
         initialize();
-        loop();
+        loop(options);
     } catch (...) {
         glfwTerminate();
         throw;
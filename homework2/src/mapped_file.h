@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fstream>
+#include <sstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read-only view of a whole file, mmap'ed where the platform allows it
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        std::ifstream in{path, std::ios::binary};
+        if (!in) {
+            throw std::runtime_error{"failed to open " + path};
+        }
+        std::stringstream ss;
+        ss << in.rdbuf();
+        fallback = ss.str();
+        data = fallback.data();
+        size = fallback.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error{"failed to open " + path};
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error{"failed to stat " + path};
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error{"failed to map " + path};
+            }
+            madvise(ptr, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(ptr);
+        }
+        close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile& that) = delete;
+    MappedFile& operator=(const MappedFile& that) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data) munmap(const_cast<char*>(data), size);
+#endif
+    }
+
+    std::string_view view() const noexcept { return {data, size}; }
+
+private:
+#ifdef _WIN32
+    std::string fallback;
+#endif
+};
+
+// size and modification time of a source file, for invalidating whatever was cooked from it
+struct SourceStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+
+    static SourceStamp of(const std::string& path) {
+        std::error_code ec;
+        SourceStamp result;
+        result.size = std::filesystem::file_size(path, ec);
+        result.mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        return result;
+    }
+
+    bool operator==(const SourceStamp& that) const = default;
+};
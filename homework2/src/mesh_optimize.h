@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "scene.h"
+#include "parallel.h"
+
+static const unsigned VERTEX_CACHE_SIZE = 16;
+
+// triangles around every vertex, in CSR form: triangles[offsets[v] .. offsets[v + 1])
+struct TriangleAdjacency {
+    std::vector<size_t> offsets;
+    std::vector<unsigned> triangles;
+
+    TriangleAdjacency(const std::vector<unsigned>& indices, size_t vertexCount) : offsets(vertexCount + 1, 0), triangles(indices.size()) {
+        for (auto index : indices) ++offsets[index + 1];
+        for (size_t v = 0; v < vertexCount; ++v) offsets[v + 1] += offsets[v];
+        auto fill = offsets;
+        for (size_t i = 0; i < indices.size(); ++i) triangles[fill[indices[i]]++] = i / 3;
+    }
+
+    size_t count(unsigned v) const { return offsets[v + 1] - offsets[v]; }
+};
+
+struct VertexCacheStats {
+    size_t triangles = 0;
+    size_t vertices = 0; // distinct vertices referenced
+    size_t misses = 0;   // vertex shader invocations
+
+    double acmr() const { return triangles ? double(misses) / triangles : 0.0; } // average cache miss ratio, >= 0.5
+    double atvr() const { return vertices ? double(misses) / vertices : 0.0; }   // average transform to vertex ratio, >= 1
+
+    VertexCacheStats& operator+=(const VertexCacheStats& that) {
+        triangles += that.triangles;
+        vertices += that.vertices;
+        misses += that.misses;
+        return *this;
+    }
+};
+
+// FIFO post-transform cache, the model Tipsify optimizes for
+static VertexCacheStats simulateVertexCache(const std::vector<unsigned>& indices, size_t vertexCount, unsigned cacheSize = VERTEX_CACHE_SIZE) {
+    VertexCacheStats result;
+    result.triangles = indices.size() / 3;
+
+    // a vertex is cached while fewer than cacheSize misses happened since it was loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    std::vector<bool> seen(vertexCount, false);
+    for (auto index : indices) {
+        if (!seen[index]) {
+            seen[index] = true;
+            ++result.vertices;
+        } else if (result.misses - loadedAt[index] < cacheSize) {
+            continue;
+        }
+        loadedAt[index] = ++result.misses;
+    }
+    return result;
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007): fans triangles around the vertex
+// expected to stay longest in the cache, in linear time
+static std::vector<unsigned> optimizeVertexCache(const std::vector<unsigned>& indices, size_t vertexCount, unsigned cacheSize = VERTEX_CACHE_SIZE) {
+    size_t triangleCount = indices.size() / 3;
+
+    TriangleAdjacency adjacency{indices, vertexCount};
+    std::vector<unsigned> live(vertexCount, 0);
+    for (size_t v = 0; v < vertexCount; ++v) live[v] = adjacency.count(v);
+
+    std::vector<size_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<unsigned> deadEnd;
+    std::vector<unsigned> candidates;
+    std::vector<unsigned> result;
+    result.reserve(indices.size());
+
+    size_t time = cacheSize + 1;
+    size_t cursor = 0;
+    long fanning = vertexCount ? 0 : -1;
+
+    while (fanning >= 0) {
+        candidates.clear();
+        for (size_t a = adjacency.offsets[fanning]; a < adjacency.offsets[fanning + 1]; ++a) {
+            unsigned t = adjacency.triangles[a];
+            if (emitted[t]) continue;
+            emitted[t] = true;
+            for (int k = 0; k < 3; ++k) {
+                unsigned v = indices[3 * t + k];
+                result.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // prefer the candidate that will still be cached after its remaining triangles are emitted
+        fanning = -1;
+        long best = -1;
+        for (auto v : candidates) {
+            if (live[v] == 0) continue;
+            long priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) priority = time - cacheTime[v];
+            if (priority > best) {
+                best = priority;
+                fanning = v;
+            }
+        }
+
+        if (fanning < 0) {
+            while (!deadEnd.empty()) {
+                unsigned v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0) {
+                    fanning = v;
+                    break;
+                }
+            }
+        }
+
+        if (fanning < 0) {
+            while (cursor < vertexCount && live[cursor] == 0) ++cursor;
+            if (cursor < vertexCount) fanning = cursor;
+        }
+    }
+
+    return result;
+}
+
+// renumbers vertices in the order the index buffer first touches them
+static void optimizeVertexFetch(std::vector<VertexData>& vertices, std::vector<unsigned>& indices) {
+    static const unsigned UNUSED = ~0u;
+    std::vector<unsigned> remap(vertices.size(), UNUSED);
+    std::vector<VertexData> result;
+    result.reserve(vertices.size());
+    for (auto& index : indices) {
+        if (remap[index] == UNUSED) {
+            remap[index] = result.size();
+            result.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices = std::move(result);
+}
+
+struct MeshOptimizeStats {
+    VertexCacheStats before, after;
+};
+
+static MeshOptimizeStats optimizeMesh(SceneObject& obj) {
+    MeshOptimizeStats result;
+    result.before = simulateVertexCache(obj.indices, obj.vertices.size());
+    obj.indices = optimizeVertexCache(obj.indices, obj.vertices.size());
+    optimizeVertexFetch(obj.vertices, obj.indices);
+    result.after = simulateVertexCache(obj.indices, obj.vertices.size());
+    return result;
+}
+
+static MeshOptimizeStats optimizeScene(Scene& scene, unsigned threads = 1) {
+    std::vector<SceneObject*> objects;
+    for (auto& [_, obj] : scene.objects) objects.push_back(&obj);
+
+    std::vector<MeshOptimizeStats> stats(objects.size());
+    parallelFor(objects.size(), threads, [&](size_t i) {
+        stats[i] = optimizeMesh(*objects[i]);
+    });
+
+    MeshOptimizeStats result;
+    for (const auto& s : stats) {
+        result.before += s.before;
+        result.after += s.after;
+    }
+    return result;
+}
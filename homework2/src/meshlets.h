@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "culling.h"
+#include "mesh_optimize.h"
+#include "parallel.h"
+
+static const unsigned MESHLET_MAX_TRIANGLES = 128;
+
+static glm::vec3 triangleNormal(const std::vector<VertexData>& vertices, const unsigned* tri) {
+    auto n = glm::cross(vertices[tri[1]].position - vertices[tri[0]].position, vertices[tri[2]].position - vertices[tri[0]].position);
+    float len = glm::length(n);
+    return len > 0.0f ? n / len : glm::vec3{0.0f};
+}
+
+static void computeMeshletBounds(Meshlet& meshlet, const std::vector<VertexData>& vertices, const std::vector<unsigned>& indices) {
+    const unsigned* begin = indices.data() + meshlet.indexOffset;
+    const unsigned* end = begin + meshlet.indexCount;
+
+    glm::vec3 lo{vertices[*begin].position}, hi{lo};
+    for (auto* i = begin; i != end; ++i) {
+        lo = glm::min(lo, vertices[*i].position);
+        hi = glm::max(hi, vertices[*i].position);
+    }
+    meshlet.center = (lo + hi) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (auto* i = begin; i != end; ++i) {
+        meshlet.radius = glm::max(meshlet.radius, glm::length(vertices[*i].position - meshlet.center));
+    }
+
+    glm::vec3 axis{0.0f};
+    for (auto* tri = begin; tri != end; tri += 3) {
+        axis += triangleNormal(vertices, tri);
+    }
+    meshlet.cone = {};
+    if (glm::length(axis) == 0.0f) return;
+    axis = glm::normalize(axis);
+
+    float cosAngle = 1.0f;
+    for (auto* tri = begin; tri != end; tri += 3) {
+        auto n = triangleNormal(vertices, tri);
+        if (n != glm::vec3{0.0f}) cosAngle = glm::min(cosAngle, glm::dot(axis, n));
+    }
+    meshlet.cone = {axis, cosAngle, glm::sqrt(glm::max(0.0f, 1.0f - cosAngle * cosAngle))};
+}
+
+// Greedily grows clusters of up to MESHLET_MAX_TRIANGLES connected triangles,
+// always taking the one closest to the cluster seed so that bounds stay tight.
+// Rewrites indices so every meshlet is contiguous; triangles keep their
+// relative order inside a meshlet, which preserves most of the cache order.
+static std::vector<Meshlet> buildMeshlets(const std::vector<VertexData>& vertices, std::vector<unsigned>& indices) {
+    size_t triangleCount = indices.size() / 3;
+    TriangleAdjacency adjacency{indices, vertices.size()};
+
+    auto centroid = [&](unsigned t) {
+        return (vertices[indices[3 * t]].position + vertices[indices[3 * t + 1]].position + vertices[indices[3 * t + 2]].position) / 3.0f;
+    };
+
+    std::vector<bool> assigned(triangleCount, false);
+    std::vector<unsigned> cluster;
+    std::vector<unsigned> result;
+    std::vector<Meshlet> meshlets;
+    result.reserve(indices.size());
+
+    using Candidate = std::pair<float, unsigned>;
+    for (unsigned seed = 0; seed < triangleCount; ++seed) {
+        if (assigned[seed]) continue;
+
+        auto origin = centroid(seed);
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> frontier;
+        frontier.push({0.0f, seed});
+        cluster.clear();
+
+        while (!frontier.empty() && cluster.size() < MESHLET_MAX_TRIANGLES) {
+            unsigned t = frontier.top().second;
+            frontier.pop();
+            if (assigned[t]) continue;
+            assigned[t] = true;
+            cluster.push_back(t);
+
+            for (int k = 0; k < 3; ++k) {
+                unsigned v = indices[3 * t + k];
+                for (size_t a = adjacency.offsets[v]; a < adjacency.offsets[v + 1]; ++a) {
+                    unsigned n = adjacency.triangles[a];
+                    if (!assigned[n]) frontier.push({glm::length(centroid(n) - origin), n});
+                }
+            }
+        }
+
+        std::sort(cluster.begin(), cluster.end());
+        auto& meshlet = meshlets.emplace_back();
+        meshlet.indexOffset = result.size();
+        for (auto t : cluster) {
+            result.insert(result.end(), indices.begin() + 3 * t, indices.begin() + 3 * t + 3);
+        }
+        meshlet.indexCount = result.size() - meshlet.indexOffset;
+    }
+
+    indices = std::move(result);
+    for (auto& meshlet : meshlets) {
+        computeMeshletBounds(meshlet, vertices, indices);
+    }
+    return meshlets;
+}
+
+static void buildSceneMeshlets(Scene& scene, unsigned threads = 1) {
+    std::vector<SceneObject*> objects;
+    for (auto& [_, obj] : scene.objects) objects.push_back(&obj);
+
+    parallelFor(objects.size(), threads, [&](size_t i) {
+        auto& obj = *objects[i];
+        obj.meshlets = buildMeshlets(obj.vertices, obj.indices);
+        optimizeVertexFetch(obj.vertices, obj.indices);
+    });
+}
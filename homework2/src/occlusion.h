@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "parallel.h"
+
+// world space triangle, one of the few large ones used as occluders
+struct OccluderTriangle {
+    glm::vec3 a, b, c;
+};
+
+static const size_t OCCLUDER_LIMIT = 8192;
+
+// the largest of the candidates, at most `limit`, none smaller than minArea
+static std::vector<OccluderTriangle> selectOccluders(std::vector<OccluderTriangle> candidates, size_t limit, float minArea) {
+    auto area = [](const OccluderTriangle& t) { return glm::length(glm::cross(t.b - t.a, t.c - t.a)) * 0.5f; };
+    std::erase_if(candidates, [&](const OccluderTriangle& t) { return area(t) < minArea; });
+    if (candidates.size() > limit) {
+        std::nth_element(candidates.begin(), candidates.begin() + limit, candidates.end(), [&](const auto& x, const auto& y) { return area(x) > area(y); });
+        candidates.resize(limit);
+    }
+    return candidates;
+}
+
+// Low resolution software depth buffer with a Hi-Z pyramid. Depth is kept
+// as 1/w, which is affine in screen space and keeps its precision over the
+// whole view range (NDC z is within 1e-3 of 1 past a few hundred units);
+// 0 is empty, larger is nearer. Occluders are rasterized in horizontal
+// bands, one band per task, so threads never share a row and the result
+// does not depend on the thread count. Rows are filled in fixed-width spans
+// the compiler can vectorize. A covered pixel takes the farthest depth of
+// the triangle inside it, triangles touching the near plane are skipped and
+// bounds touching it are kept; coverage is sampled at pixel centers.
+struct OcclusionBuffer {
+    static constexpr int WIDTH = 256, HEIGHT = 128;
+    static constexpr int BAND_HEIGHT = 16;
+    static constexpr int SPAN = 8;
+    static constexpr float NEAREST_W = 1e-4f;
+
+    std::vector<float> depth = std::vector<float>(WIDTH * HEIGHT, 0.0f); // 1/w of the nearest occluder, row major
+    std::vector<std::vector<float>> pyramid;                            // level i is (WIDTH >> i + 1) x (HEIGHT >> i + 1), farthest of 2x2 below
+    glm::mat4 viewProjection{1.0f};
+
+    // screen space triangle: pixel coordinates and 1/w
+    struct ScreenTriangle {
+        glm::vec3 v[3];
+    };
+    std::vector<ScreenTriangle> triangles;
+
+    mutable size_t tested = 0, occluded = 0;
+
+    void render(const glm::mat4& transform, const std::vector<OccluderTriangle>& occluders, ThreadPool& pool) {
+        viewProjection = transform;
+        triangles.clear();
+        for (const auto& t : occluders) {
+            ScreenTriangle screen;
+            bool clipped = false;
+            const glm::vec3* world[3] = {&t.a, &t.b, &t.c};
+            for (int i = 0; i < 3; ++i) {
+                auto p = viewProjection * glm::vec4{*world[i], 1.0f};
+                if (p.w <= NEAREST_W || p.z < -p.w) {
+                    clipped = true;
+                    break;
+                }
+                screen.v[i] = {(p.x / p.w * 0.5f + 0.5f) * WIDTH, (p.y / p.w * 0.5f + 0.5f) * HEIGHT, 1.0f / p.w};
+            }
+            if (clipped) continue;
+
+            // back faces are culled when drawing, so they hide nothing; only counter-clockwise ones stay
+            const auto& v = screen.v;
+            float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+            if (area <= 0.0f) continue;
+            triangles.push_back(screen);
+        }
+
+        std::fill(depth.begin(), depth.end(), 0.0f);
+        pool.parallelFor(HEIGHT / BAND_HEIGHT, [&](size_t band) {
+            for (const auto& triangle : triangles) rasterize(triangle, band * BAND_HEIGHT, (band + 1) * BAND_HEIGHT);
+        });
+        buildPyramid();
+    }
+
+    // the sphere's bounding box is entirely behind the occluders
+    bool occludedSphere(glm::vec3 center, float radius) const {
+        return occludedBox(center - radius, center + radius);
+    }
+
+    bool occludedBox(glm::vec3 lo, glm::vec3 hi) const {
+        ++tested;
+        float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, nearest = 0.0f;
+        for (int i = 0; i < 8; ++i) {
+            glm::vec3 corner{i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z};
+            auto p = viewProjection * glm::vec4{corner, 1.0f};
+            if (p.w <= NEAREST_W) return false;
+            float x = (p.x / p.w * 0.5f + 0.5f) * WIDTH, y = (p.y / p.w * 0.5f + 0.5f) * HEIGHT;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            nearest = std::max(nearest, 1.0f / p.w);
+        }
+
+        int x0 = std::max(int(std::floor(minX)), 0), x1 = std::min(int(std::floor(maxX)), WIDTH - 1);
+        int y0 = std::max(int(std::floor(minY)), 0), y1 = std::min(int(std::floor(maxY)), HEIGHT - 1);
+        if (x0 > x1 || y0 > y1) return false; // off screen, the frustum test decides
+
+        // the level where the rectangle spans at most 2x2 texels
+        int level = 0;
+        while (level < int(pyramid.size()) && std::max(x1 - x0, y1 - y0) >= 2) {
+            x0 >>= 1, x1 >>= 1, y0 >>= 1, y1 >>= 1;
+            ++level;
+        }
+        const float* texels = level == 0 ? depth.data() : pyramid[level - 1].data();
+        int width = WIDTH >> level;
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                if (nearest >= texels[y * width + x]) return false;
+            }
+        }
+        ++occluded;
+        return true;
+    }
+
+private:
+    void rasterize(const ScreenTriangle& t, int bandStart, int bandEnd) {
+        const auto& v = t.v;
+        int x0 = std::max(int(std::floor(std::min({v[0].x, v[1].x, v[2].x}))), 0);
+        int x1 = std::min(int(std::ceil(std::max({v[0].x, v[1].x, v[2].x}))), WIDTH - 1);
+        int y0 = std::max(int(std::floor(std::min({v[0].y, v[1].y, v[2].y}))), bandStart);
+        int y1 = std::min(int(std::ceil(std::max({v[0].y, v[1].y, v[2].y}))), bandEnd - 1);
+        if (x0 > x1 || y0 > y1) return;
+
+        // edge functions and the depth plane, at pixel centers
+        glm::vec3 a, b, c;
+        for (int i = 0; i < 3; ++i) {
+            const auto& p = v[(i + 1) % 3];
+            const auto& q = v[(i + 2) % 3];
+            a[i] = p.y - q.y;
+            b[i] = q.x - p.x;
+            c[i] = p.x * q.y - p.y * q.x;
+        }
+        float area = c[0] + c[1] + c[2];
+        glm::vec3 z{v[0].z, v[1].z, v[2].z};
+        float dzdx = glm::dot(a, z) / area, dzdy = glm::dot(b, z) / area, z0 = z[0] - dzdx * v[0].x - dzdy * v[0].y;
+
+        // the farthest the triangle gets inside a pixel
+        z0 -= 0.5f * (std::abs(dzdx) + std::abs(dzdy));
+
+        for (int y = y0; y <= y1; ++y) {
+            float py = y + 0.5f;
+            float* row = depth.data() + y * WIDTH;
+            for (int x = x0; x <= x1; x += SPAN) {
+                std::array<float, SPAN> values;
+                int count = std::min(SPAN, x1 - x + 1);
+                for (int i = 0; i < SPAN; ++i) {
+                    float px = x + i + 0.5f;
+                    float e0 = a[0] * px + b[0] * py + c[0];
+                    float e1 = a[1] * px + b[1] * py + c[1];
+                    float e2 = a[2] * px + b[2] * py + c[2];
+                    float d = z0 + dzdx * px + dzdy * py;
+                    bool inside = e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f && i < count;
+                    values[i] = inside ? d : 0.0f;
+                }
+                for (int i = 0; i < count; ++i) row[x + i] = std::max(row[x + i], values[i]);
+            }
+        }
+    }
+
+    void buildPyramid() {
+        pyramid.resize(std::bit_width(unsigned(std::min(WIDTH, HEIGHT))) - 1);
+        const float* below = depth.data();
+        int width = WIDTH;
+        for (auto& level : pyramid) {
+            int w = width / 2, h = HEIGHT * w / WIDTH;
+            level.resize(w * h);
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x) {
+                    const float* p = below + (y * 2) * width + x * 2;
+                    level[y * w + x] = std::min(std::min(p[0], p[1]), std::min(p[width], p[width + 1]));
+                }
+            }
+            below = level.data();
+            width = w;
+        }
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static unsigned workerCount() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// runs body(i) for every i in [0, count) on up to `threads` threads, the calling one included
+static void parallelFor(size_t count, unsigned threads, auto body) {
+    threads = std::min<size_t>(threads, count);
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; ++i) body(i);
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < count;) body(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool) thread.join();
+}
+
+// persistent workers for fire-and-forget jobs, joined on destruction
+struct ThreadPool {
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool& that) = delete;
+    ThreadPool& operator=(const ThreadPool& that) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard lock{mutex};
+            jobs.push_back(std::move(job));
+        }
+        wakeup.notify_one();
+    }
+
+    // Like the free parallelFor, on the idle workers and the calling thread,
+    // without starting threads; returns once every body(i) has. Must not be
+    // called from one of this pool's jobs.
+    void parallelFor(size_t count, auto body) {
+        size_t helpers = std::min(workers.size(), count > 0 ? count - 1 : 0);
+        std::atomic<size_t> next{0};
+        auto worker = [&] {
+            for (size_t i; (i = next++) < count;) body(i);
+        };
+
+        // notified under the lock, so the helpers are done with these before they go out of scope
+        std::mutex doneMutex;
+        std::condition_variable doneChanged;
+        size_t running = helpers;
+        for (size_t i = 0; i < helpers; ++i) {
+            submit([&] {
+                worker();
+                std::lock_guard lock{doneMutex};
+                --running;
+                doneChanged.notify_one();
+            });
+        }
+        worker();
+        std::unique_lock lock{doneMutex};
+        doneChanged.wait(lock, [&] { return running == 0; });
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock lock{mutex};
+                wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
@@ -1,149 +1,627 @@
 #pragma once
 
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
 #include "scene.h"
+#include "parallel.h"
 #include "gl_objects.h"
 #include "shaders.h"
 #include "camera.h"
+#include "vertex_format.h"
+#include "culling.h"
+#include "texture_cooker.h"
+#include "render_state.h"
+#include "draw_commands.h"
+#include "uniform_blocks.h"
+#include "shader_permutations.h"
+#include "clusters.h"
+#include "gbuffer.h"
+#include "shadows.h"
+#include "shadow_atlas.h"
 #include <stb_image.h>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
-static GLenum formats[] = {
-    GL_RED,
-    GL_RG,
-    GL_RGB,
-    GL_RGBA
+// S3TC is an extension in every desktop driver, but not part of the GL 3.3 core profile
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+static GLenum glBlockFormat(BlockFormat format) {
+    switch (format) {
+        case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BlockFormat::BC4: return GL_COMPRESSED_RED_RGTC1;
+        case BlockFormat::BC5: return GL_COMPRESSED_RG_RGTC2;
+        case BlockFormat::RGBA8: return GL_RGBA8;
+    }
+    return GL_NONE;
+}
+
+static bool hasExtension(std::string_view name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+        if (name == reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i))) return true;
+    }
+    return false;
+}
+
+static const char* textureSuffix(TextureKind kind) {
+    switch (kind) {
+        case TextureKind::Color: return ".color.cache";
+        case TextureKind::Linear: return ".linear.cache";
+        case TextureKind::Normal: return ".normal.cache";
+    }
+    return ".cache";
+}
+
+// 1-based index of a texture in TextureManager, 0 for no texture
+using TextureHandle = unsigned;
+
+struct DecodedTexture {
+    TextureHandle handle;
+    std::optional<CookedTexture> texture;
 };
 
+// Textures are loaded on a thread pool and packed into GL_TEXTURE_2D_ARRAYs,
+// one per format and mip chain size, a layer per texture. Layer counts are
+// only known once every requested texture is decoded, so the arrays of a
+// batch are allocated then, and the mip tails of its layers are uploaded by
+// update() on the GL thread a few at a time. Until its tail is uploaded a
+// texture has no location and samples as a placeholder. Block-compressed
+// mips are cooked from the PNG on first use and stored next to it as
+// <name><kind>.cache.
+//
+// Finer mips are streamed in as request() asks for them and evicted, least
+// recently used first, when the arrays would outgrow budget. An array only
+// has storage from the finest level any of its layers has, its base; a
+// layer that has less samples no finer than its own level. Shrinking or
+// growing an array reallocates it and uploads its layers again from the
+// cooked mip chains, which stay in system memory.
 struct TextureManager {
-    std::unordered_map<std::string, Texture> textures;
+    static const int MAX_UPLOADS_PER_FRAME = 4;
+    static const int MAX_LAYERS = 1 << 12; // what location() has room for
+    static const int TAIL_SIZE = 64;       // levels this small are never evicted
+    static const uint32_t NOT_RESIDENT = 0xffff;
+
+    struct Entry {
+        std::string key;
+        std::optional<CookedTexture> source; // once decoded
+        int array = -1, layer = 0;
+        int resident = -1;                   // the finest uploaded level, -1 until the tail is
+        int wanted = INT_MAX;                // the finest level requested since the last update
+        uint64_t lastUsed = 0;               // the update a request came before
+
+        explicit Entry(std::string key) : key{std::move(key)} {}
+    };
+
+    struct TextureArray {
+        Texture texture;
+        BlockFormat format;
+        std::vector<glm::ivec2> sizes;   // of the full mip chain
+        std::vector<size_t> levelBytes;  // of one layer
+        int tail = 0;                    // the first level of the mip tail
+        int base = 0;                    // the first level with storage
+        std::vector<TextureHandle> layers;
+
+        size_t bytes(int from) const {
+            return std::accumulate(levelBytes.begin() + from, levelBytes.end(), size_t(0)) * layers.size();
+        }
+    };
+
+    struct Stats {
+        size_t residentBytes = 0;  // of every array, mip tails included
+        size_t pendingUploads = 0; // textures that want finer mips than they have
+        size_t budgetMisses = 0;   // requests that did not fit in the budget, in total
+        size_t uploads = 0, evictions = 0;
+    };
+
+    std::unordered_map<std::string, TextureHandle> handles; // by key
+    std::vector<Entry> entries;
+    std::vector<TextureArray> arrays;    // bound to units 0 to MAX_TEXTURE_ARRAYS - 1 by DrawableScene
+    std::vector<DecodedTexture> decoded; // of the current batch, until all of it is decoded
+    std::vector<TextureHandle> tails;    // waiting for their mip tail
+    size_t decodingCount = 0, pendingCount = 0; // GL thread only
+    unsigned generation = 0;                    // bumped by every upload or eviction, location() may have changed
+    uint64_t frame = 0;                         // updates so far
+    size_t budget = SIZE_MAX;                   // bytes of array storage
+    Stats stats;
+    bool hasS3TC = false;
+
+    std::mutex readyMutex;
+    std::condition_variable readyChanged;
+    std::vector<DecodedTexture> ready;
+
+    ThreadPool decoders{workerCount()};
 
     static TextureManager& instance() {
         static TextureManager singleton;
         return singleton;
     }
 
-    static GLuint get(const std::string& name) {
+    static CookedTexture cook(const std::string& path, TextureKind kind) {
+        int width, height, chans;
+        std::unique_ptr<stbi_uc, void (*)(void*)> pixels{stbi_load(path.c_str(), &width, &height, &chans, 4), stbi_image_free};
+        if (!pixels) {
+            throw std::runtime_error{"failed to load texture " + path};
+        }
+        Image image{width, height, {pixels.get(), pixels.get() + 4 * size_t(width) * height}};
+        return cookTexture(std::move(image), kind);
+    }
+
+    static TextureHandle get(const std::string& name, TextureKind kind = TextureKind::Color) {
         if (name.empty()) return 0;
-        if (!instance().textures.contains(name)) {
-            instance().textures[name];
-            GLuint id = instance().textures.at(name).Id;
-            glBindTexture(GL_TEXTURE_2D, id);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            std::stringstream path;
-            path << "./sponza/" << name;
-            int width, height, chans;
-            auto ptr = stbi_load(path.str().c_str(), &width, &height, &chans, 0);
-            if (!ptr) {
-                throw std::runtime_error{"failed to load texture"};
-            }
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, formats[chans - 1], GL_UNSIGNED_BYTE, ptr);
-            glGenerateMipmap(GL_TEXTURE_2D);
-            stbi_image_free(ptr);
-        }
-        return instance().textures.at(name).Id;
+        auto& self = instance();
+        auto key = name + textureSuffix(kind);
+        if (auto it = self.handles.find(key); it != self.handles.end()) return it->second;
+
+        self.entries.emplace_back(key);
+        TextureHandle handle = self.entries.size();
+        self.handles.emplace(key, handle);
+
+        ++self.decodingCount;
+        ++self.pendingCount;
+        self.decoders.submit([&self, name, key, kind, handle] {
+            DecodedTexture result;
+            result.handle = handle;
+            auto path = "./sponza/" + name;
+            auto cachePath = "./sponza/" + key;
+            auto stamp = SourceStamp::of(path);
+            try {
+                result.texture = loadCookedTexture(cachePath, stamp, kind);
+                if (!result.texture) {
+                    result.texture = cook(path, kind);
+                    writeCookedTexture(cachePath, *result.texture, stamp, kind);
+                }
+                if (!self.hasS3TC) decompressS3TC(*result.texture);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                result.texture.reset();
+            }
+
+            std::lock_guard lock{self.readyMutex};
+            self.ready.push_back(std::move(result));
+            self.readyChanged.notify_all();
+        });
+        return handle;
+    }
+
+    // 16 bits for MaterialBlock::maps: array << 12 | layer, NOT_RESIDENT for no texture or one not uploaded yet
+    static uint32_t location(TextureHandle handle) {
+        if (handle == 0) return NOT_RESIDENT;
+        const auto& entry = instance().entries[handle - 1];
+        return entry.resident < 0 ? NOT_RESIDENT : uint32_t(entry.array) << 12 | uint32_t(entry.layer);
+    }
+
+    // 4 bits for MaterialBlock::maps: the levels of the array the layer does not have
+    static uint32_t minLod(TextureHandle handle) {
+        if (handle == 0) return 0;
+        const auto& self = instance();
+        const auto& entry = self.entries[handle - 1];
+        return entry.resident < 0 ? 0 : std::min(entry.resident - self.arrays[entry.array].base, 15);
+    }
+
+    // a visible surface samples the texture at uvPerPixel of its texture coordinates per pixel
+    static void request(TextureHandle handle, float uvPerPixel) {
+        if (handle == 0) return;
+        auto& self = instance();
+        auto& entry = self.entries[handle - 1];
+        entry.lastUsed = self.frame;
+        if (entry.array < 0) return;
+        const auto& array = self.arrays[entry.array];
+        float texels = uvPerPixel * std::max(array.sizes[0].x, array.sizes[0].y);
+        int level = texels > 1.0f ? int(std::log2(texels)) : 0;
+        entry.wanted = std::min({entry.wanted, level, array.tail});
+    }
+
+    // Uploads up to maxUploads mip tails, then streams up to maxUploads
+    // requested levels; call once per frame on the GL thread.
+    static void update(int maxUploads = MAX_UPLOADS_PER_FRAME) {
+        auto& self = instance();
+        {
+            std::lock_guard lock{self.readyMutex};
+            self.decodingCount -= self.ready.size();
+            std::move(self.ready.begin(), self.ready.end(), std::back_inserter(self.decoded));
+            self.ready.clear();
+        }
+        if (self.decodingCount == 0 && !self.decoded.empty()) {
+            self.allocateArrays();
+        }
+
+        int n = std::min<int>(maxUploads, self.tails.size());
+        for (int i = 0; i < n; ++i) {
+            auto& entry = self.entries[self.tails.back() - 1];
+            entry.resident = self.arrays[entry.array].tail;
+            self.uploadLevels(entry, entry.resident, entry.source->levels.size());
+            self.tails.pop_back();
+            --self.pendingCount;
+            ++self.generation;
+        }
+
+        self.stream(maxUploads);
+        for (auto& entry : self.entries) entry.wanted = INT_MAX;
+        ++self.frame;
+        self.stats.residentBytes = self.residentBytes();
+    }
+
+    static size_t pending() {
+        return instance().pendingCount;
+    }
+
+    // blocks until every requested texture has its mip tail uploaded
+    static void finish() {
+        auto& self = instance();
+        while (self.pendingCount > 0) {
+            if (self.tails.empty()) {
+                std::unique_lock lock{self.readyMutex};
+                self.readyChanged.wait(lock, [&] { return !self.ready.empty(); });
+            }
+            update(std::numeric_limits<int>::max());
+        }
     }
 
 private:
-    TextureManager() = default;
-};
+    TextureManager() : hasS3TC{hasExtension("GL_EXT_texture_compression_s3tc")} {}
 
-struct DrawableSceneObject {
-    VertexArray vao;
-    Buffer vbo, ebo;
-    int vertexCount;
+    // format, width, height, mip count
+    using GroupKey = std::tuple<BlockFormat, int, int, size_t>;
 
-    GLuint map_Ka;
-    GLuint map_Kd;
-    GLuint map_Ks;
-    GLuint map_d;
-    GLuint norm;
+    // Allocates the arrays of the decoded batch and queues its mip tails. A
+    // group larger than the layer limit takes several arrays. When the groups
+    // need more arrays than there are units, the smallest group that is a mip
+    // of another one drops its top levels and joins it, until they fit.
+    void allocateArrays() {
+        GLint maxLayers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+        maxLayers = std::min(maxLayers, MAX_LAYERS);
 
-    glm::vec3 Ka;
-    glm::vec3 Kd;
-    glm::vec3 Ks;
-    float Ns;
+        std::map<GroupKey, std::vector<DecodedTexture>> groups;
+        for (auto& texture : decoded) {
+            if (!texture.texture) {
+                throw std::runtime_error{"failed to load texture " + entries[texture.handle - 1].key};
+            }
+            const auto& levels = texture.texture->levels;
+            groups[{texture.texture->format, levels[0].width, levels[0].height, levels.size()}].push_back(std::move(texture));
+        }
+        decoded.clear();
 
-    void init(const SceneObject& obj) {
-        glBindVertexArray(vao);
+        auto arraysNeeded = [&] {
+            size_t count = arrays.size();
+            for (const auto& [_, group] : groups) count += (group.size() + maxLayers - 1) / maxLayers;
+            return count;
+        };
+        while (arraysNeeded() > MAX_TEXTURE_ARRAYS) {
+            auto merged = groups.end();
+            GroupKey target;
+            for (auto it = groups.begin(); it != groups.end(); ++it) {
+                const auto& levels = it->second.front().texture->levels;
+                for (size_t i = 1; i < levels.size(); ++i) {
+                    GroupKey key{std::get<0>(it->first), levels[i].width, levels[i].height, levels.size() - i};
+                    if (!groups.contains(key)) continue;
+                    if (merged == groups.end() || it->second.size() < merged->second.size()) {
+                        merged = it;
+                        target = key;
+                    }
+                    break;
+                }
+            }
+            if (merged == groups.end()) {
+                throw std::runtime_error{"textures need more than " + std::to_string(MAX_TEXTURE_ARRAYS) + " texture arrays"};
+            }
+            size_t dropped = std::get<3>(merged->first) - std::get<3>(target);
+            auto group = std::move(merged->second);
+            groups.erase(merged);
+            for (auto& texture : group) {
+                auto& levels = texture.texture->levels;
+                levels.erase(levels.begin(), levels.begin() + dropped);
+                groups[target].push_back(std::move(texture));
+            }
+        }
 
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, obj.vertices.size() * sizeof(obj.vertices[0]), obj.vertices.data(), GL_STATIC_DRAW);
+        for (auto& [key, group] : groups) {
+            for (size_t first = 0; first < group.size(); first += maxLayers) {
+                auto& array = arrays.emplace_back();
+                const auto& shape = *group[first].texture;
+                array.format = shape.format;
+                for (const auto& level : shape.levels) {
+                    array.sizes.push_back({level.width, level.height});
+                    array.levelBytes.push_back(level.data.size());
+                }
+                while (array.tail + 1 < int(array.sizes.size()) && std::max(array.sizes[array.tail].x, array.sizes[array.tail].y) > TAIL_SIZE) {
+                    ++array.tail;
+                }
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj.indices.size() * sizeof(obj.indices[0]), obj.indices.data(), GL_STATIC_DRAW);
+                for (size_t i = first; i < std::min<size_t>(first + maxLayers, group.size()); ++i) {
+                    auto& entry = entries[group[i].handle - 1];
+                    entry.source = std::move(group[i].texture);
+                    entry.array = arrays.size() - 1;
+                    entry.layer = array.layers.size();
+                    array.layers.push_back(group[i].handle);
+                    tails.push_back(group[i].handle);
+                }
+                allocate(array, array.tail);
+            }
+        }
+    }
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(obj.vertices[0]), (void*)offsetof(VertexData, position));
+    // fresh storage from level base, with every layer that has its tail uploaded again
+    void allocate(TextureArray& array, int base) {
+        Texture texture;
+        std::swap(array.texture, texture);
+        array.base = base;
+        int layers = array.layers.size();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+        for (int i = base; i < int(array.sizes.size()); ++i) {
+            auto size = array.sizes[i];
+            if (array.format == BlockFormat::RGBA8) {
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, i - base, GL_RGBA8, size.x, size.y, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            } else {
+                glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i - base, glBlockFormat(array.format), size.x, size.y, layers, 0, array.levelBytes[i] * layers, nullptr);
+            }
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, array.sizes.size() - 1 - base);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        auto size = array.sizes[0];
+        array.texture.label(GpuCategory::Materials, "texture array " + std::to_string(size.x) + "x" + std::to_string(size.y) + "x" + std::to_string(layers)
+                                                    + " from level " + std::to_string(base));
+        array.texture.allocated(array.bytes(base));
 
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(obj.vertices[0]), (void*)offsetof(VertexData, texcoord));
+        for (auto handle : array.layers) {
+            const auto& entry = entries[handle - 1];
+            if (entry.resident >= 0) uploadLevels(entry, entry.resident, array.sizes.size());
+        }
+        ++generation;
+    }
 
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(obj.vertices[0]), (void*)offsetof(VertexData, normal));
+    // levels [first, end) of the entry's mip chain into its layer; first must not be below the array's base
+    void uploadLevels(const Entry& entry, int first, int end) {
+        const auto& array = arrays[entry.array];
+        glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+        for (int i = first; i < end; ++i) {
+            const auto& level = entry.source->levels[i];
+            if (array.format == BlockFormat::RGBA8) {
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i - array.base, 0, 0, entry.layer, level.width, level.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, level.data.data());
+            } else {
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i - array.base, 0, 0, entry.layer, level.width, level.height, 1, glBlockFormat(array.format), level.data.size(), level.data.data());
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
 
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(obj.vertices[0]), (void*)offsetof(VertexData, tangent));
+    size_t residentBytes() const {
+        size_t total = 0;
+        for (const auto& array : arrays) total += array.bytes(array.base);
+        return total;
+    }
 
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(obj.vertices[0]), (void*)offsetof(VertexData, bitangent));
+    // Gives the requested textures their wanted level, the largest shortfall
+    // first. Levels below the array's base grow it; when the budget does not
+    // allow that, the finest level it allows is streamed and a miss counted.
+    void stream(int maxUploads) {
+        std::vector<TextureHandle> wanting;
+        for (TextureHandle handle = 1; handle <= entries.size(); ++handle) {
+            const auto& entry = entries[handle - 1];
+            if (entry.resident >= 0 && entry.wanted < entry.resident) wanting.push_back(handle);
+        }
+        std::sort(wanting.begin(), wanting.end(), [&](auto a, auto b) {
+            const auto &x = entries[a - 1], &y = entries[b - 1];
+            return x.resident - x.wanted > y.resident - y.wanted;
+        });
 
-        glBindVertexArray(0);
+        size_t streamed = 0;
+        for (auto handle : wanting) {
+            if (int(streamed) == maxUploads) break;
+            auto& entry = entries[handle - 1];
+            auto& array = arrays[entry.array];
+            int level = entry.wanted;
+            while (level < array.base && !makeRoom(handle, level)) ++level;
+            if (level > entry.wanted) ++stats.budgetMisses;
+            if (level >= entry.resident) continue;
+
+            if (level < array.base) {
+                entry.resident = level;
+                allocate(array, level);
+            } else {
+                uploadLevels(entry, level, entry.resident);
+                entry.resident = level;
+            }
+            ++streamed;
+            ++stats.uploads;
+            ++generation;
+        }
+        stats.pendingUploads = wanting.size() - streamed;
+    }
+
+    // Textures that were not requested since the last update, or have finer
+    // levels than requested, give them up when another array has to grow.
+    bool evictable(TextureHandle other, TextureHandle keep) const {
+        const auto& entry = entries[other - 1];
+        if (entry.array == entries[keep - 1].array || entry.resident < 0 || entry.resident >= arrays[entry.array].tail) return false;
+        return entry.lastUsed != frame || entry.resident < entry.wanted;
+    }
+
+    int evictedLevel(const Entry& entry) const {
+        return entry.lastUsed == frame ? entry.wanted : arrays[entry.array].tail;
+    }
+
+    // the finest level any layer has, counting the evictable ones as evicted
+    int leastBase(const TextureArray& array, TextureHandle keep) const {
+        int base = array.tail;
+        for (auto layer : array.layers) {
+            const auto& entry = entries[layer - 1];
+            if (entry.resident >= 0) base = std::min(base, evictable(layer, keep) ? evictedLevel(entry) : entry.resident);
+        }
+        return base;
+    }
+
+    // Evicts until growing the handle's array to level fits in the budget,
+    // least recently used first. Evicts nothing when it cannot fit anyway.
+    bool makeRoom(TextureHandle handle, int level) {
+        const auto& grown = arrays[entries[handle - 1].array];
+        auto needed = [&] { return residentBytes() - grown.bytes(grown.base) + grown.bytes(std::min(level, grown.base)); };
+        size_t least = 0;
+        for (const auto& array : arrays) {
+            least += &array == &grown ? array.bytes(std::min(level, array.base)) : array.bytes(leastBase(array, handle));
+        }
+        if (least > budget) return false;
+
+        while (needed() > budget) {
+            // a layer above its array's base frees nothing
+            Entry* victim = nullptr;
+            for (TextureHandle other = 1; other <= entries.size(); ++other) {
+                auto& entry = entries[other - 1];
+                if (!evictable(other, handle) || entry.resident != arrays[entry.array].base) continue;
+                if (!victim || entry.lastUsed < victim->lastUsed) victim = &entry;
+            }
+            if (!victim) return false;
+
+            auto& array = arrays[victim->array];
+            victim->resident = evictedLevel(*victim);
+            ++stats.evictions;
+            ++generation;
+            int base = array.tail;
+            for (auto layer : array.layers) {
+                int resident = entries[layer - 1].resident;
+                if (resident >= 0) base = std::min(base, resident);
+            }
+            if (base > array.base) allocate(array, base);
+        }
+        return true;
+    }
+};
+
+struct DrawableSceneObject {
+    GLuint firstIndex = 0; // into the scene index buffer
+    GLint baseVertex = 0;  // into the scene vertex buffer
+    unsigned indexCount = 0;
+    std::vector<Meshlet> meshlets;
+    glm::vec3 center{0.0f}; // bounding sphere, for the depth part of the draw key
+    float radius = 0.0f;
+    float uvDensity = 0.0f; // texture coordinate units per world unit, on average, for TextureManager::request
+    unsigned textureSet = 0; // index of (map_Ka, map_Kd, map_d, norm, map_Ks) among the scene's distinct sets
+    int materialIndex = 0;   // into the Materials uniform block
+    const ShaderPermutations::Permutation* program = nullptr;       // main pass
+    const ShaderPermutations::Permutation* shadowProgram = nullptr; // shadow pass
+    const ShaderPermutations::Permutation* gbufferProgram = nullptr; // G-buffer pass, opaque objects only
+
+    TextureHandle map_Ka;
+    TextureHandle map_Kd;
+    TextureHandle map_Ks;
+    TextureHandle map_d;
+    TextureHandle norm;
+
+    glm::vec3 Ka;
+    glm::vec3 Kd;
+    glm::vec3 Ks;
+    float Ns;
+
+    // obj is a SceneObject or a CookedSceneObject; geometry is uploaded by DrawableScene
+    void init(const auto& obj) {
+        auto box = packedBounds(obj.vertices);
+        center = box.offset + box.scale * 0.5f;
+        radius = glm::length(box.scale) * 0.5f;
 
         map_Ka = TextureManager::get(obj.material.map_Ka);
         map_Kd = TextureManager::get(obj.material.map_Kd);
-        map_Ks = TextureManager::get(obj.material.map_Ks);
-        map_d = TextureManager::get(obj.material.map_d);
-        norm = TextureManager::get(obj.material.norm);
+        map_Ks = TextureManager::get(obj.material.map_Ks, TextureKind::Linear);
+        map_d = TextureManager::get(obj.material.map_d, TextureKind::Linear);
+        norm = TextureManager::get(obj.material.norm, TextureKind::Normal);
 
         Ka = obj.material.Ka;
         Kd = obj.material.Kd;
         Ks = obj.material.Ks;
         Ns = obj.material.Ns;
 
-        vertexCount = obj.indices.size();
-    }
+        indexCount = obj.indices.size();
+        meshlets.assign(obj.meshlets.begin(), obj.meshlets.end());
 
-    void renderFlat() const {
-        glBindVertexArray(vao);
-        glDrawElements(GL_TRIANGLES, vertexCount, GL_UNSIGNED_INT, nullptr);
-        glBindVertexArray(0);
+        double worldArea = 0.0, uvArea = 0.0;
+        for (size_t i = 0; i + 2 < obj.indices.size(); i += 3) {
+            const auto& a = obj.vertices[obj.indices[i]];
+            const auto& b = obj.vertices[obj.indices[i + 1]];
+            const auto& c = obj.vertices[obj.indices[i + 2]];
+            worldArea += glm::length(glm::cross(b.position - a.position, c.position - a.position));
+            uvArea += std::abs(glm::determinant(glm::mat2{b.texcoord - a.texcoord, c.texcoord - a.texcoord}));
+        }
+        uvDensity = worldArea > 0.0 ? std::sqrt(uvArea / worldArea) : 0.0;
     }
 
-    void render(const Program& shader) const {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, map_Ka);
-        shader.setUniform("uniform_Ka", Ka);
-        shader.setUniform("has_Ka", map_Ka != 0);
+    // appends the visible meshlets to ranges as index ranges, merging neighbours; false if nothing is visible
+    bool cull(const CullView& view, std::vector<std::pair<GLuint, GLuint>>& ranges) const {
+        if (meshlets.empty()) {
+            if (indexCount > 0) ranges.push_back({0, indexCount});
+            return indexCount > 0;
+        }
 
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, map_Kd);
-        shader.setUniform("uniform_Kd", Kd);
-        shader.setUniform("has_Kd", map_Kd != 0);
+        size_t first = ranges.size();
+        unsigned end = ~0u;
+        for (const auto& meshlet : meshlets) {
+            if (!view.visible(meshlet.center, meshlet.radius, meshlet.cone)) continue;
+            if (meshlet.indexOffset == end) {
+                ranges.back().second += meshlet.indexCount;
+            } else {
+                ranges.push_back({meshlet.indexOffset, meshlet.indexCount});
+            }
+            end = meshlet.indexOffset + meshlet.indexCount;
+        }
+        return ranges.size() > first;
+    }
 
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, map_d);
-        shader.setUniform("has_d", map_d != 0);
+    BlendMode blendMode() const {
+        return map_d ? BlendMode::Alpha : BlendMode::Opaque;
+    }
 
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, norm);
-        shader.setUniform("has_norm", norm != 0);
+    // where the maps are changes as TextureManager uploads them
+    MaterialBlock materialBlock() const {
+        auto at = TextureManager::location;
+        auto lod = TextureManager::minLod;
+        glm::uvec4 maps{
+            at(map_Ka) | at(map_Kd) << 16,
+            at(map_d) | at(norm) << 16,
+            at(map_Ks),
+            lod(map_Ka) | lod(map_Kd) << 4 | lod(map_d) << 8 | lod(norm) << 12 | lod(map_Ks) << 16,
+        };
+        return {glm::vec4{Ka, 0.0f}, glm::vec4{Kd, 0.0f}, glm::vec4{Ks, Ns}, maps};
+    }
 
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, map_Ks);
-        shader.setUniform("uniform_Ks", Ks);
-        shader.setUniform("has_Ks", map_Ks != 0);
+    // the minimal permutation: only the maps this material has
+    unsigned features() const {
+        return (map_Ka ? unsigned(FEATURE_KA) : 0u) | (map_Kd ? unsigned(FEATURE_KD) : 0u) | (map_d ? unsigned(FEATURE_D) : 0u) | (norm ? unsigned(FEATURE_NORM) : 0u)
+             | (map_Ks ? unsigned(FEATURE_KS) : 0u);
+    }
 
-        shader.setUniform("Ns", Ns);
+    unsigned shadowFeatures() const {
+        return FEATURE_DEPTH_ONLY | (map_d ? unsigned(FEATURE_D) : 0u);
+    }
 
-        renderFlat();
+    // selects the pass' program and the material it reads, the maps are bound once per pass
+    void bindMaterial(RenderStateCache& state, const ShaderPermutations::Permutation& permutation) const {
+        state.useProgram(permutation.program);
+        state.setUniform(permutation.program, "material_index", materialIndex);
     }
 };
 
@@ -155,96 +633,642 @@ struct Light {
     bool directional;
 };
 
-static const unsigned SHADOW_WIDTH = 8192, SHADOW_HEIGHT = 8192;
+enum class RenderPath {
+    Forward,
+    Deferred, // opaque objects through the G-buffer, blended ones forward on top
+};
+
+// The main pass of one frame, worked out without GL: the culled and sorted
+// draws, the pre-pass order and the light clusters, and the settings they
+// follow. DrawableScene::prepare fills it, render draws it.
+struct RenderList {
+    Camera camera;
+    bool depthPrepass = false, occlusionCulling = false;
+    DrawList draws;
+    CommandList prepass; // opaque draws nearest first, with depthPrepass
+    ClusterGrid clusters;
+    OcclusionBuffer occlusion;
+    size_t meshletsOccluded = 0;
+    double prepareMs = 0.0;
+};
 
 struct DrawableScene {
+    bool packedVertices = true; // upload PackedVertexData instead of VertexData, must be set before init
     std::vector<DrawableSceneObject> objects;
-    Program shader;
-    Framebuffer shadowFBO;
-    Texture shadowTexture;
-    glm::mat4 shadowTransform;
+    VertexArray vao;
+    Buffer vbo, ebo;
+    PackedBounds bounds; // of the whole scene
+    ShaderPermutations shaders;
+    Buffer lightsUBO, materialsUBO, frameUBO, shadowAtlasUBO;
+    CascadedShadowMap shadows;
+    ShadowAtlas shadowAtlas;
+    std::vector<CascadeFit> cascadeFits;
+    std::optional<ShadowAtlasBlock> uploadedAtlas;
+    std::vector<uint32_t> casterMaps; // location | minLod << 16 of every object's map_d, as the shadows were drawn with
+    unsigned castersGeneration = ~0u; // TextureManager::generation casterMaps were taken at
+    RenderPath path = RenderPath::Forward;
+    bool depthPrepass = false; // forward path only
+    bool occlusionCulling = false;
+    std::vector<OccluderTriangle> occluders; // world space, the largest opaque triangles
+    const ShaderPermutations::Permutation* deferredLighting = nullptr;
+    const ShaderPermutations::Permutation* depthOnly = nullptr;
+    mutable GBuffer gbuffer;
+    mutable DrawCommands prepassCommands;
+    mutable SampleCounter shadedSamples, prepassSamples;
+    bool timePasses = false; // GL_TIME_ELAPSED around every GpuPass, kept in passTimers' history
+    mutable std::array<GpuTimer, size_t(GpuPass::Count)> passTimers;
+
+    mutable RenderStateCache state;
+    mutable RenderStats stats; // of the last render()
+    mutable DrawList shadowList;
+    mutable DrawCommands commands; // of the pass being drawn
+    mutable RenderList renderList; // for render(camera, lights)
+    std::unique_ptr<ThreadPool> prepareWorkers = std::make_unique<ThreadPool>(workerCount() - 1); // prepare() helps them
+    mutable std::vector<LightBlock> uploadedLights;
+    mutable unsigned materialsGeneration = ~0u; // TextureManager::generation the materials were uploaded at
+    mutable TextureBuffer lightRecords, clusterRanges, clusterLights;
+    size_t maxTextureBufferTexels = 0;
 
-    void init(const Scene& scene) {
+    // culls every object into list, orders the survivors by their draw key and lays out their ranges in that order; no GL
+    void buildDrawList(const CullView& view, DrawPass pass, glm::vec3 eye, DrawList& list) const {
+        list.items.clear();
+        list.ranges.clear();
+        list.objectsOccluded = 0;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            const auto& obj = objects[i];
+            if (view.occluded(obj.center, obj.radius)) {
+                ++list.objectsOccluded;
+                continue;
+            }
+            size_t firstRange = list.ranges.size();
+            if (!obj.cull(view, list.ranges)) continue;
+            float distance = glm::length(obj.center - eye);
+            unsigned program = pass == DrawPass::Shadow ? obj.shadowProgram->index : obj.program->index;
+            uint64_t key = DrawKey::make(pass, obj.blendMode(), program, obj.textureSet, distance);
+            list.items.push_back({key, i, firstRange, list.ranges.size() - firstRange});
+        }
+        std::sort(list.items.begin(), list.items.end(), [](const auto& a, const auto& b) { return std::tie(a.key, a.object) < std::tie(b.key, b.object); });
+
+        list.commands.clear();
+        for (auto& item : list.items) {
+            const auto& obj = objects[item.object];
+            item.firstCommand = list.commands.size();
+            for (size_t r = item.firstRange; r < item.firstRange + item.rangeCount; ++r) {
+                list.commands.add(obj.firstIndex + list.ranges[r].first, list.ranges[r].second, obj.baseVertex);
+            }
+            item.commandCount = list.commands.size() - item.firstCommand;
+        }
+    }
+
+    // one vertex and one index buffer for the whole scene, behind a single VAO
+    void allocateGeometry(const auto& scene) {
+        size_t vertexCount = 0, indexCount = 0;
         for (const auto& [_, obj] : scene.objects) {
-            objects.emplace_back().init(obj);
+            vertexCount += obj.vertices.size();
+            indexCount += obj.indices.size();
         }
 
-        std::sort(objects.begin(), objects.end(), [](const auto& lhs, const auto& rhs) {
-            return lhs.map_d < rhs.map_d;
-        });
+        glm::vec3 lo{std::numeric_limits<float>::max()}, hi{-std::numeric_limits<float>::max()};
+        for (const auto& [_, obj] : scene.objects) {
+            if (obj.vertices.empty()) continue;
+            auto box = packedBounds(obj.vertices);
+            lo = glm::min(lo, box.offset);
+            hi = glm::max(hi, box.offset + box.scale);
+        }
+        bounds = lo.x <= hi.x ? PackedBounds{lo, hi - lo} : PackedBounds{};
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        vbo.label(GpuCategory::Geometry, "scene vertices");
+        vbo.allocate(GL_ARRAY_BUFFER, vertexCount * (packedVertices ? sizeof(PackedVertexData) : sizeof(VertexData)), nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        ebo.label(GpuCategory::Geometry, "scene indices");
+        ebo.allocate(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned), nullptr, GL_STATIC_DRAW);
+
+        if (packedVertices) {
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertexData), (void*)offsetof(PackedVertexData, position));
+
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertexData), (void*)offsetof(PackedVertexData, texcoord));
+
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 4, GL_SHORT, GL_TRUE, sizeof(PackedVertexData), (void*)offsetof(PackedVertexData, qtangent));
+        } else {
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
+
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, texcoord));
+
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
+
+            glEnableVertexAttribArray(3);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, tangent));
+
+            glEnableVertexAttribArray(4);
+            glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, bitangent));
+        }
+
+        glBindVertexArray(0);
+    }
+
+    // suballocates obj from the shared buffers, right after the previous object
+    void upload(DrawableSceneObject& drawable, const auto& obj, size_t& vertexOffset, size_t& indexOffset) {
+        drawable.baseVertex = vertexOffset;
+        drawable.firstIndex = indexOffset;
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (packedVertices) {
+            auto vertices = packVertices(obj.vertices, bounds);
+            glBufferSubData(GL_ARRAY_BUFFER, vertexOffset * sizeof(vertices[0]), vertices.size() * sizeof(vertices[0]), vertices.data());
+        } else {
+            glBufferSubData(GL_ARRAY_BUFFER, vertexOffset * sizeof(obj.vertices[0]), obj.vertices.size() * sizeof(obj.vertices[0]), obj.vertices.data());
+        }
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexOffset * sizeof(unsigned), obj.indices.size() * sizeof(unsigned), obj.indices.data());
+
+        vertexOffset += obj.vertices.size();
+        indexOffset += obj.indices.size();
+    }
+
+    // Rewrites the light records only when some light changed, and uploads
+    // the cluster lists prepare() built every frame.
+    void updateLights(const ClusterGrid& clusters, const std::vector<Light>& lights) const {
+        if (lights.size() > MAX_LIGHTS) {
+            throw std::runtime_error{"too many lights"};
+        }
+        std::vector<LightBlock> records;
+        for (size_t i = 0; i < lights.size(); ++i) {
+            const auto& light = lights[i];
+            float slot = i < shadowAtlas.shadows.size() ? shadowAtlas.shadows[i].slot : -1;
+            records.push_back({light.position, float(light.directional), light.diffuse, slot, light.specular, 0.0f, light.attenuation, 0.0f});
+        }
+        if (records.size() != uploadedLights.size() || std::memcmp(records.data(), uploadedLights.data(), records.size() * sizeof(LightBlock)) != 0) {
+            lightRecords.upload(GL_RGBA32F, records.data(), records.size() * sizeof(LightBlock));
+            uploadedLights = std::move(records);
+        }
+
+        if (clusters.indices.size() > maxTextureBufferTexels) {
+            throw std::runtime_error{"too many lights in the clusters"};
+        }
+        clusterRanges.upload(GL_RG32UI, clusters.ranges.data(), clusters.ranges.size() * sizeof(uint32_t));
+        clusterLights.upload(GL_R32UI, clusters.indices.data(), clusters.indices.size() * sizeof(uint32_t));
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        LightsBlock block{glm::vec2{viewport[2], viewport[3]}, clusters.near, clusters.sliceScale()};
+        glBindBuffer(GL_UNIFORM_BUFFER, lightsUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    void updateFrame(const glm::mat4& view, const glm::mat4& projection, glm::vec3 eye) const {
+        FrameBlock block{};
+        block.view = view;
+        block.projection = projection;
+        for (unsigned i = 0; i < shadows.cascadeCount; ++i) {
+            block.shadowTransforms[i] = shadows.cascades[i].transform;
+            block.cascadeSplits[i] = shadows.cascades[i].valid ? shadows.cascades[i].splitFar : 0.0f;
+            block.cascadeBias[i] = shadows.cascades[i].bias;
+        }
+        block.cameraPosition = glm::vec4{eye, 1.0f};
+        block.positionOffset = glm::vec4{bounds.offset, 0.0f};
+        block.positionScale = glm::vec4{bounds.scale, 0.0f};
+        block.cascadeCount = shadows.cascadeCount;
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // Asks TextureManager for the mips the drawn objects need: a texel per
+    // pixel at the nearest point of their bounds, at their average density.
+    void requestMips(const Camera& camera, const DrawList& list) const {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        float pixelsPerUnit = viewport[3] / (2.0f * std::tan(camera.fov * 0.5f)); // at distance 1
+        for (const auto& item : list.items) {
+            const auto& obj = objects[item.object];
+            float distance = std::max(glm::length(obj.center - camera.position) - obj.radius, camera.zNear);
+            float uvPerPixel = obj.uvDensity * distance / pixelsPerUnit;
+            for (auto map : {obj.map_Ka, obj.map_Kd, obj.map_d, obj.norm, obj.map_Ks}) TextureManager::request(map, uvPerPixel);
+        }
+    }
+
+    // rewrites every material when a texture landed in its layer since the last call
+    void updateMaterials() const {
+        unsigned generation = TextureManager::instance().generation;
+        if (generation == materialsGeneration) return;
+        std::vector<MaterialBlock> materials;
+        for (const auto& obj : objects) materials.push_back(obj.materialBlock());
+        glBindBuffer(GL_UNIFORM_BUFFER, materialsUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, materials.size() * sizeof(MaterialBlock), materials.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        materialsGeneration = generation;
+    }
+
+    // every texture array, for the material passes
+    void bindMaterialMaps() const {
+        const auto& arrays = TextureManager::instance().arrays;
+        for (size_t i = 0; i < arrays.size(); ++i) state.bindTexture(i, arrays[i].texture, GL_TEXTURE_2D_ARRAY);
+    }
+
+    // uniform blocks, material maps and the VAO, once per pass
+    void beginGeometry() const {
+        glBindBufferBase(GL_UNIFORM_BUFFER, LIGHTS_BINDING, lightsUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, MATERIALS_BINDING, materialsUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, frameUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, SHADOW_ATLAS_BINDING, shadowAtlasUBO);
+        bindMaterialMaps();
+        glBindVertexArray(vao);
+    }
+
+    void init(const auto& scene) {
+        commands.indirect = GLAD_GL_VERSION_4_3;
+        allocateGeometry(scene);
+        size_t vertexOffset = 0, indexOffset = 0;
+        std::vector<OccluderTriangle> candidates;
+        for (const auto& [_, obj] : scene.objects) {
+            auto& drawable = objects.emplace_back();
+            drawable.init(obj);
+            upload(drawable, obj, vertexOffset, indexOffset);
+            if (drawable.blendMode() != BlendMode::Opaque) continue;
+            for (size_t i = 0; i + 2 < obj.indices.size(); i += 3) {
+                candidates.push_back({obj.vertices[obj.indices[i]].position, obj.vertices[obj.indices[i + 1]].position, obj.vertices[obj.indices[i + 2]].position});
+            }
+        }
+        occluders = selectOccluders(std::move(candidates), OCCLUDER_LIMIT, 0.0f);
+
+        std::map<std::array<TextureHandle, 5>, unsigned> textureSets;
+        for (const auto& obj : objects) {
+            textureSets.emplace(std::array<TextureHandle, 5>{obj.map_Ka, obj.map_Kd, obj.map_d, obj.norm, obj.map_Ks}, 0);
+        }
+        unsigned next = 0;
+        for (auto& [_, id] : textureSets) id = next++;
+        for (auto& obj : objects) {
+            obj.textureSet = textureSets.at({obj.map_Ka, obj.map_Kd, obj.map_d, obj.norm, obj.map_Ks});
+        }
+
+        if (objects.size() > MAX_MATERIALS) {
+            throw std::runtime_error{"too many materials"};
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            objects[i].materialIndex = i;
+        }
+        auto allocateUniforms = [](const Buffer& buffer, const char* name, size_t bytes) {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            buffer.label(GpuCategory::Uniforms, name);
+            buffer.allocate(GL_UNIFORM_BUFFER, bytes, nullptr, GL_DYNAMIC_DRAW);
+        };
+        allocateUniforms(materialsUBO, "Materials block", sizeof(MaterialBlock) * MAX_MATERIALS);
+        updateMaterials();
+        allocateUniforms(lightsUBO, "Lights block", sizeof(LightsBlock));
+        allocateUniforms(frameUBO, "Frame block", sizeof(FrameBlock));
+        allocateUniforms(shadowAtlasUBO, "ShadowAtlas block", sizeof(ShadowAtlasBlock));
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+        // every permutation the scene needs is compiled up front, not in the middle of a pass
+        shaders.packedVertices = packedVertices;
+        for (auto& obj : objects) {
+            obj.program = &shaders.get(obj.features());
+            obj.shadowProgram = &shaders.get(obj.shadowFeatures());
+            if (obj.blendMode() == BlendMode::Opaque) obj.gbufferProgram = &shaders.get(obj.features() | FEATURE_GBUFFER);
+        }
+        deferredLighting = &shaders.get(FEATURE_DEFERRED_LIGHTING);
+        depthOnly = &shaders.get(FEATURE_DEPTH_ONLY);
+        prepassCommands.indirect = commands.indirect;
+        glUseProgram(0);
+
+        shadows.allocate();
+        shadowAtlas.allocate();
+        GLint texels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &texels);
+        maxTextureBufferTexels = texels;
+
+        commands.buffer.label(GpuCategory::Commands, "draw commands");
+        prepassCommands.buffer.label(GpuCategory::Commands, "pre-pass commands");
+        lightRecords.buffer.label(GpuCategory::Lights, "light records");
+        clusterRanges.buffer.label(GpuCategory::Lights, "cluster ranges");
+        clusterLights.buffer.label(GpuCategory::Lights, "cluster lights");
+    }
+
+    // one draw call, counted in the stats
+    void draw(const DrawCommands& list, size_t first, size_t count) const {
+        if (count == 0) return;
+        list.draw(first, count);
+        ++state.stats.drawCalls;
+        state.stats.triangles += list.indexCount(first, count) / 3;
+    }
 
-        shader = createProgram(
-            createShader(GL_VERTEX_SHADER, SCENE_VERTEX_SHADER),
-            createShader(GL_FRAGMENT_SHADER, SCENE_FRAGMENT_SHADER)
-        );
+    void beginPass(GpuPass pass) const {
+        if (timePasses) passTimers[size_t(pass)].begin();
+    }
 
-        glBindTexture(GL_TEXTURE_2D, shadowTexture);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    void endPass(GpuPass pass) const {
+        if (timePasses) passTimers[size_t(pass)].end();
     }
 
-    void calculateShadows(const Light& light) {
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowTexture, 0);
+    // depth-only draw of list, into whatever is bound
+    void drawShadowCasters(const DrawList& list) const {
+        commands.upload(list.commands);
+        beginGeometry();
+
+        // opaque objects sort first and share the plain depth-only program, so they are one draw
+        auto alphaTested = std::find_if(list.items.begin(), list.items.end(), [&](const auto& item) { return objects[item.object].map_d != 0; });
+        if (alphaTested != list.items.begin()) {
+            state.useProgram(objects[list.items.front().object].shadowProgram->program);
+            draw(commands, 0, alphaTested == list.items.end() ? commands.size() : alphaTested->firstCommand);
+        }
+        for (auto it = alphaTested; it != list.items.end(); ++it) {
+            const auto& obj = objects[it->object];
+            obj.bindMaterial(state, *obj.shadowProgram);
+            draw(commands, it->firstCommand, it->commandCount);
+        }
+        glBindVertexArray(0);
+    }
+
+    // Alpha-tested casters are drawn with whatever of their map_d is resident,
+    // none before it lands; invalidates the point shadows reaching those whose
+    // map moved or changed levels since the last call, returns whether any did.
+    bool updateCasterMaps() {
+        unsigned generation = TextureManager::instance().generation;
+        if (generation == castersGeneration) return false;
+        castersGeneration = generation;
+        casterMaps.resize(objects.size(), ~0u);
+        bool changed = false;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            const auto& obj = objects[i];
+            if (!obj.map_d) continue;
+            uint32_t map = TextureManager::location(obj.map_d) | TextureManager::minLod(obj.map_d) << 16;
+            if (map == casterMaps[i]) continue;
+            casterMaps[i] = map;
+            shadowAtlas.invalidate(obj.center, obj.radius);
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Redraws what moved since the last frame: the cascades of the first
+    // directional light and the atlas tiles of the point lights.
+    void calculateShadows(const Camera& camera, const std::vector<Light>& lights) {
+        updateMaterials();
+        bool castersChanged = updateCasterMaps();
+        auto directional = std::find_if(lights.begin(), lights.end(), [](const Light& light) { return light.directional; });
+        std::vector<unsigned> cascades;
+        if (directional != lights.end()) {
+            cascades = shadows.update(camera, directional->position, bounds.offset, bounds.offset + bounds.scale, cascadeFits, castersChanged);
+        }
+        auto faces = shadowAtlas.update(camera, lights);
+        auto block = shadowAtlas.block();
+        if (!uploadedAtlas || std::memcmp(&*uploadedAtlas, &block, sizeof(block)) != 0) {
+            uploadedAtlas = block;
+            glBindBuffer(GL_UNIFORM_BUFFER, shadowAtlasUBO);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+        if (cascades.empty() && faces.empty()) return;
+
+        GLint viewport[4], framebuffer;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+
+        beginPass(GpuPass::Shadows);
+        glBindFramebuffer(GL_FRAMEBUFFER, shadows.framebuffer);
         glDrawBuffer(GL_NONE);
         glReadBuffer(GL_NONE);
+        glViewport(0, 0, shadows.resolution, shadows.resolution);
+        for (unsigned i : cascades) {
+            const auto& fit = cascadeFits[i];
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadows.depth, 0, i);
+            glClear(GL_DEPTH_BUFFER_BIT);
 
-        glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-        glClear(GL_DEPTH_BUFFER_BIT);
+            state.reset();
+            updateFrame(fit.view, fit.projection, fit.eye);
+            buildDrawList(CullView::ortho(shadows.cascades[i].transform, -shadows.toLight), DrawPass::Shadow, fit.eye, shadowList);
+            drawShadowCasters(shadowList);
+        }
 
-        // draw to shadow space
-        auto view = glm::lookAt(light.position * 3000.0f, glm::vec3{0.0f, 0.0f, 0.0f}, glm::vec3{0.0f, 1.0f, 0.0f});
-        auto projection = glm::ortho(-3000.0f, 3000.0f, -3000.0f, 3000.0f, 1.0f, 5000.0f);
+        if (!faces.empty()) {
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.framebuffer);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowAtlas.depth, 0);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            // tiles share the texture, so clears must not leave the tile
+            glEnable(GL_SCISSOR_TEST);
+            for (auto [light, face] : faces) {
+                const auto& shadow = shadowAtlas.shadows[light];
+                const auto& tile = shadow.faces[face];
+                glViewport(tile.x, tile.y, tile.size, tile.size);
+                glScissor(tile.x, tile.y, tile.size, tile.size);
+                glClear(GL_DEPTH_BUFFER_BIT);
 
-        glUseProgram(shader);
-        shader.setUniform("is_drawing_shadows", true);
-        shader.setUniform("view", view);
-        shader.setUniform("projection", projection);
-        shadowTransform = projection * view;
+                auto view = shadowAtlas.faceView(shadow, face);
+                auto projection = shadowAtlas.faceProjection(shadow);
+                state.reset();
+                updateFrame(view, projection, shadow.position);
+                buildDrawList(CullView::perspective(projection * view, shadow.position), DrawPass::Shadow, shadow.position, shadowList);
+                drawShadowCasters(shadowList);
+            }
+            glDisable(GL_SCISSOR_TEST);
+        }
+        endPass(GpuPass::Shadows);
 
-        for (const auto& obj : objects) {
-            obj.renderFlat();
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+
+    // copies the settings prepare() follows into list; the pre-pass is forward only
+    RenderList& configure(RenderList& list) const {
+        list.depthPrepass = depthPrepass && path == RenderPath::Forward;
+        list.occlusionCulling = occlusionCulling;
+        return list;
+    }
+
+    // Culls and sorts the main pass for camera, orders the pre-pass and
+    // assigns the lights to clusters, into list; its depthPrepass and
+    // occlusionCulling choose, not the scene's, see configure(). Reads only what init() set
+    // and writes only list, so it may run on another thread while the GL
+    // thread is in calculateShadows() or render().
+    void prepare(const Camera& camera, const std::vector<Light>& lights, RenderList& list) const {
+        auto start = std::chrono::steady_clock::now();
+        list.camera = camera;
+
+        auto viewProjection = camera.projection() * camera.view();
+        if (list.occlusionCulling) {
+            list.occlusion.render(viewProjection, occluders, *prepareWorkers);
+            list.occlusion.occluded = 0;
         }
+        buildDrawList(CullView::perspective(viewProjection, camera.position, list.occlusionCulling ? &list.occlusion : nullptr), DrawPass::Main, camera.position, list.draws);
+        list.meshletsOccluded = list.occlusionCulling ? list.occlusion.occluded - list.draws.objectsOccluded : 0;
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        // opaque objects, nearest first; blended ones sort last and stay out
+        list.prepass.clear();
+        if (list.depthPrepass) {
+            std::vector<std::pair<float, size_t>> order; // (distance, item)
+            for (size_t i = 0; i < list.draws.items.size(); ++i) {
+                const auto& obj = objects[list.draws.items[i].object];
+                if (obj.blendMode() == BlendMode::Alpha) break;
+                order.emplace_back(std::max(glm::length(obj.center - camera.position) - obj.radius, 0.0f), i);
+            }
+            std::sort(order.begin(), order.end());
+            for (auto [_, i] : order) {
+                const auto& item = list.draws.items[i];
+                const auto& obj = objects[item.object];
+                for (size_t r = item.firstRange; r < item.firstRange + item.rangeCount; ++r) {
+                    list.prepass.add(obj.firstIndex + list.draws.ranges[r].first, list.draws.ranges[r].second, obj.baseVertex);
+                }
+            }
+        }
 
-        glBindTexture(GL_TEXTURE_2D, shadowTexture);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        std::vector<LightSphere> spheres;
+        for (const auto& light : lights) {
+            spheres.push_back({light.position, light.directional ? INFINITY : lightRange(light.attenuation)});
+        }
+        list.clusters.far = camera.zFar;
+        list.clusters.assign(camera.view(), camera.fov, camera.aspectRatio, spheres, *prepareWorkers);
+        list.prepareMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
     }
 
+    // draws a prepared frame with the path selected by path; shadows must be up to date for list.camera
+    void render(const RenderList& list, const std::vector<Light>& lights) const {
+        auto shadowPass = state.stats;
+        state.reset();
+        state.stats = {};
+        stats = {};
+        const auto& camera = list.camera;
+        updateFrame(camera.view(), camera.projection(), camera.position);
+        updateLights(list.clusters, lights);
+        updateMaterials();
+        commands.upload(list.draws.commands);
+        requestMips(camera, list.draws);
+        beginGeometry();
+        bindLighting();
+        if (path == RenderPath::Deferred) {
+            renderDeferred(list);
+        } else {
+            renderForward(list);
+        }
+        glBindVertexArray(0);
+        stats = state.stats;
+        stats.samplesShaded = shadedSamples.last;
+        stats.samplesPrepass = list.depthPrepass ? prepassSamples.last : 0;
+        stats.objectsOccluded = list.draws.objectsOccluded;
+        stats.meshletsOccluded = list.meshletsOccluded;
+        stats.shadowDrawCalls = shadowPass.drawCalls;
+        stats.shadowTriangles = shadowPass.triangles;
+        stats.prepareMs = list.prepareMs;
+        state.stats = {};
+    }
+
+    // prepares and draws in one go, on the calling thread
     void render(const Camera& camera, const std::vector<Light>& lights) const {
-        glUseProgram(shader);
-        shader.setUniform("is_drawing_shadows", false);
-        shader.setUniform("view", camera.view());
-        shader.setUniform("projection", camera.projection());
-        shader.setUniform("sampler_Ka", 0);
-        shader.setUniform("sampler_Kd", 1);
-        shader.setUniform("sampler_d", 2);
-        shader.setUniform("sampler_norm", 3);
-        shader.setUniform("sampler_Ks", 4);
-        shader.setUniform("sampler_shadow", 5);
-
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_2D, shadowTexture);
-
-        shader.setUniform("camera_position", camera.position);
-        shader.setUniform("shadow_transform", shadowTransform);
-
-        int n = (int)lights.size();
-        shader.setUniform("lights_size", n);
-        for (int i = 0; i < n; ++i) {
-            shader.setUniform("lights[" + std::to_string(i) + "].position", lights[i].position);
-            shader.setUniform("lights[" + std::to_string(i) + "].diffuse", lights[i].diffuse);
-            shader.setUniform("lights[" + std::to_string(i) + "].specular", lights[i].specular);
-            shader.setUniform("lights[" + std::to_string(i) + "].attenuation", lights[i].attenuation);
-            shader.setUniform("lights[" + std::to_string(i) + "].directional", lights[i].directional);
+        prepare(camera, lights, configure(renderList));
+        render(renderList, lights);
+    }
+
+    // Opaque objects, then blended ones. With depthPrepass, opaque depth is
+    // laid down first, nearest object first, by the plain depth-only program
+    // in one draw, so the lighting shader only runs on the visible samples.
+    // Blended objects are their own bucket: they stay out of the pre-pass and
+    // are tested against it as usual.
+    void renderForward(const RenderList& list) const {
+        const auto& items = list.draws.items;
+        auto blended = std::find_if(items.begin(), items.end(), [&](const auto& item) { return objects[item.object].blendMode() == BlendMode::Alpha; });
+
+        if (list.depthPrepass) {
+            prepassCommands.upload(list.prepass);
+
+            beginPass(GpuPass::Prepass);
+            prepassSamples.begin();
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            state.useProgram(depthOnly->program);
+            draw(prepassCommands, 0, prepassCommands.size());
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            prepassSamples.end();
+            endPass(GpuPass::Prepass);
+
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
         }
 
-        for (const auto& obj : objects) {
-            obj.render(shader);
+        beginPass(GpuPass::Opaque);
+        shadedSamples.begin();
+        for (auto it = items.begin(); it != blended; ++it) {
+            const auto& obj = objects[it->object];
+            obj.bindMaterial(state, *obj.program);
+            draw(commands, it->firstCommand, it->commandCount);
+        }
+        shadedSamples.end();
+        endPass(GpuPass::Opaque);
+
+        if (list.depthPrepass) {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        }
+        beginPass(GpuPass::Blended);
+        for (auto it = blended; it != items.end(); ++it) {
+            const auto& obj = objects[it->object];
+            obj.bindMaterial(state, *obj.program);
+            draw(commands, it->firstCommand, it->commandCount);
+        }
+        endPass(GpuPass::Blended);
+    }
+
+    // shadow maps and light lists, for whatever shades
+    void bindLighting() const {
+        state.bindTexture(11, shadows.depth, GL_TEXTURE_2D_ARRAY);
+        state.bindTexture(12, shadowAtlas.depth);
+        state.bindTexture(13, lightRecords.texture, GL_TEXTURE_BUFFER);
+        state.bindTexture(14, clusterRanges.texture, GL_TEXTURE_BUFFER);
+        state.bindTexture(15, clusterLights.texture, GL_TEXTURE_BUFFER);
+    }
+
+    // Opaque objects write the G-buffer, one fullscreen pass shades it into the
+    // bound framebuffer and restores its depth, then blended objects go forward.
+    void renderDeferred(const RenderList& list) const {
+        GLint viewport[4], framebuffer;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+        gbuffer.resize(viewport[2], viewport[3]);
+
+        beginPass(GpuPass::Opaque);
+        glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.framebuffer);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_BLEND); // the alpha channels hold data
+        const auto& items = list.draws.items;
+        auto blended = std::find_if(items.begin(), items.end(), [&](const auto& item) { return objects[item.object].blendMode() == BlendMode::Alpha; });
+        for (auto it = items.begin(); it != blended; ++it) {
+            const auto& obj = objects[it->object];
+            obj.bindMaterial(state, *obj.gbufferProgram);
+            draw(commands, it->firstCommand, it->commandCount);
+        }
+        glEnable(GL_BLEND);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        endPass(GpuPass::Opaque);
+
+        beginPass(GpuPass::Lighting);
+        state.bindTexture(0, gbuffer.albedo);
+        state.bindTexture(1, gbuffer.normal);
+        state.bindTexture(2, gbuffer.ambient);
+        state.bindTexture(3, gbuffer.depth);
+        state.useProgram(deferredLighting->program);
+        state.setUniform(deferredLighting->program, "inverse_view_projection", glm::inverse(list.camera.projection() * list.camera.view()));
+        glDepthFunc(GL_ALWAYS);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glDepthFunc(GL_LESS);
+        ++state.stats.drawCalls;
+        ++state.stats.triangles;
+        endPass(GpuPass::Lighting);
+
+        beginPass(GpuPass::Blended);
+        bindMaterialMaps(); // the G-buffer took the first units
+        for (auto it = blended; it != items.end(); ++it) {
+            const auto& obj = objects[it->object];
+            obj.bindMaterial(state, *obj.program);
+            draw(commands, it->firstCommand, it->commandCount);
         }
+        endPass(GpuPass::Blended);
     }
 };
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include <glad/glad.h>
+#include "gl_objects.h"
+
+enum class DrawPass : uint64_t {
+    Shadow = 0,
+    Main = 1,
+};
+
+enum class BlendMode : uint64_t {
+    Opaque = 0,
+    Alpha = 1, // has map_d, drawn after everything opaque
+};
+
+// 64-bit draw order, most significant first:
+//   opaque:  pass (2) | blend (1) | program (8) | texture set (29) | depth (24)
+//   blended: pass (2) | blend (1) | inverted depth (24) | program (8) | texture set (29)
+// so blended draws go back to front regardless of their program and textures.
+struct DrawKey {
+    static uint64_t depthBits(float distance) {
+        // the bits of a non-negative float sort like the float itself
+        return std::bit_cast<uint32_t>(std::max(distance, 0.0f)) >> 8;
+    }
+
+    static uint64_t make(DrawPass pass, BlendMode blend, unsigned program, unsigned textureSet, float distance) {
+        uint64_t key = uint64_t(pass) << 62 | uint64_t(blend) << 61;
+        uint64_t state = uint64_t(program & 0xff) << 29 | (textureSet & 0x1fffffff);
+        if (blend == BlendMode::Opaque) {
+            return key | state << 24 | depthBits(distance);
+        }
+        return key | (0xffffff - depthBits(distance)) << 37 | state;
+    }
+};
+
+struct RenderStats {
+    size_t bindsIssued = 0, bindsSkipped = 0;
+    size_t uniformsIssued = 0, uniformsSkipped = 0;
+    uint64_t samplesShaded = 0, samplesPrepass = 0; // opaque lighting and depth pre-pass, a few frames late
+    size_t objectsOccluded = 0, meshletsOccluded = 0; // by the software occlusion buffer, main pass
+    size_t drawCalls = 0, triangles = 0;               // main pass
+    size_t shadowDrawCalls = 0, shadowTriangles = 0;   // calculateShadows since the previous render
+    double prepareMs = 0.0;                            // CPU time of DrawableScene::prepare for the frame
+};
+
+// A GL query (GL_SAMPLES_PASSED, GL_TIME_ELAPSED) around a span of draws.
+// Results are collected a few frames late from a ring of queries, so reading
+// them never stalls unless the GPU falls a whole ring behind.
+template <GLenum TARGET>
+struct QueryCounter {
+    static const size_t RING = 3;
+
+    std::array<Query, RING> queries;
+    std::array<bool, RING> pending{};
+    size_t next = 0;
+    uint64_t last = 0;             // the newest available result
+    bool keepHistory = false;
+    std::vector<uint64_t> history; // every result in order, with keepHistory
+
+    void begin() {
+        poll();
+        if (pending[next]) collect(next);
+        glBeginQuery(TARGET, queries[next]);
+    }
+
+    void end() {
+        glEndQuery(TARGET);
+        pending[next] = true;
+        next = (next + 1) % RING;
+    }
+
+    // oldest first, stops at the first one still in flight
+    void poll() {
+        for (size_t i = 0; i < RING; ++i) {
+            size_t slot = (next + i) % RING;
+            if (!pending[slot]) continue;
+            GLuint available = 0;
+            glGetQueryObjectuiv(queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) return;
+            collect(slot);
+        }
+    }
+
+    // waits for every query in flight
+    void finish() {
+        for (size_t i = 0; i < RING; ++i) {
+            size_t slot = (next + i) % RING;
+            if (pending[slot]) collect(slot);
+        }
+    }
+
+private:
+    void collect(size_t slot) {
+        GLuint64 result = 0;
+        glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &result);
+        last = result;
+        if (keepHistory) history.push_back(result);
+        pending[slot] = false;
+    }
+};
+
+using SampleCounter = QueryCounter<GL_SAMPLES_PASSED>;
+using GpuTimer = QueryCounter<GL_TIME_ELAPSED>; // nanoseconds
+
+// what DrawableScene times on the GPU with timePasses; Opaque is the G-buffer fill on the deferred path
+enum class GpuPass {
+    Shadows,
+    Prepass,
+    Opaque,
+    Lighting,
+    Blended,
+    Count,
+};
+
+static const char* const GPU_PASS_NAMES[] = {"shadows", "prepass", "opaque", "lighting", "blended"};
+
+// Filters out binds and uniform uploads that would not change anything.
+// Bindings are only trusted within a frame (TextureManager::update binds
+// behind its back), so reset() has to be called at the start of every pass.
+struct RenderStateCache {
+    static const int MAX_TEXTURE_UNITS = 16;
+
+    RenderStats stats;
+    GLuint program = 0;
+    GLenum activeUnit = GL_TEXTURE0;
+    std::array<GLuint, MAX_TEXTURE_UNITS> textures{};
+    std::unordered_map<uint64_t, std::array<char, sizeof(glm::mat4)>> uniforms; // by program << 32 | name hash
+
+    void reset() {
+        program = 0;
+        activeUnit = GL_TEXTURE0;
+        textures.fill(~0u);
+        uniforms.clear();
+        glActiveTexture(activeUnit);
+    }
+
+    void useProgram(const Program& shader) {
+        if (program == shader) {
+            ++stats.bindsSkipped;
+            return;
+        }
+        program = shader;
+        glUseProgram(shader);
+        ++stats.bindsIssued;
+    }
+
+    // units are tracked by id alone; a unit may move to another target, the old one stays bound
+    void bindTexture(unsigned unit, GLuint id, GLenum target = GL_TEXTURE_2D) {
+        if (textures[unit] == id) {
+            ++stats.bindsSkipped;
+            return;
+        }
+        textures[unit] = id;
+        if (activeUnit != GL_TEXTURE0 + unit) {
+            activeUnit = GL_TEXTURE0 + unit;
+            glActiveTexture(activeUnit);
+        }
+        glBindTexture(target, id);
+        ++stats.bindsIssued;
+    }
+
+    void setUniform(const Program& shader, UniformName name, auto value) {
+        static_assert(sizeof(value) <= sizeof(glm::mat4));
+        std::array<char, sizeof(glm::mat4)> bytes{};
+        std::memcpy(bytes.data(), &value, sizeof(value));
+
+        auto [it, inserted] = uniforms.try_emplace(uint64_t(shader.Id) << 32 | name.hash, bytes);
+        if (!inserted && it->second == bytes) {
+            ++stats.uniformsSkipped;
+            return;
+        }
+        it->second = bytes;
+        shader.setUniform(name, value);
+        ++stats.uniformsIssued;
+    }
+};
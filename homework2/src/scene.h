@@ -4,11 +4,66 @@
 #include <unordered_map>
 #include <vector>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "parallel.h"
+#include "culling.h"
 
-#define PARSE_VEC3_2(name, target) do { if (cmd == name) { auto& _T = target; ss >> _T.x >> _T.y >> _T.z; } } while (0)
+#define PARSE_VEC3_2(name, target) do { if (cmd == name) { auto& _T = target; parseValue(line, _T.x); parseValue(line, _T.y); parseValue(line, _T.z); } } while (0)
 #define PARSE_VEC3(name) PARSE_VEC3_2(#name, M.name)
-#define PARSE_SCALAR(name) do { if (cmd == #name) { ss >> M.name; } } while (0)
+#define PARSE_SCALAR(name) do { if (cmd == #name) { parseValue(line, M.name); } } while (0)
+
+// in-place tokenizer: every helper consumes its input from the front of the view
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static std::string_view nextLine(std::string_view& text) {
+    auto end = text.find('\n');
+    auto line = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return line;
+}
+
+static std::string_view nextToken(std::string_view& line) {
+    size_t begin = 0;
+    while (begin < line.size() && isBlank(line[begin])) ++begin;
+    size_t end = begin;
+    while (end < line.size() && !isBlank(line[end])) ++end;
+    auto token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
+}
+
+static void parseValue(std::string_view& line, float& out) {
+    auto token = nextToken(line);
+    if (token.starts_with('+')) token.remove_prefix(1);
+    if (std::from_chars(token.data(), token.data() + token.size(), out).ec != std::errc{}) {
+        out = 0.0f;
+    }
+}
+
+static void parseValue(std::string_view& line, std::string& out) {
+    out = nextToken(line);
+}
+
+// parses "v/vt/vn" (also "v//vn" and "v"), returning zero-based indices, -1 if absent
+static void parseFace(std::string_view token, int& vi, int& vti, int& vni) {
+    int idx[3] = {0, 0, 0};
+    const char* p = token.data();
+    const char* end = p + token.size();
+    for (int k = 0; k < 3 && p < end; ++k) {
+        p = std::from_chars(p, end, idx[k]).ptr;
+        if (p < end && *p == '/') ++p;
+    }
+    vi = idx[0] - 1;
+    vti = idx[1] - 1;
+    vni = idx[2] - 1;
+}
 
 struct Material {
     glm::vec3 Ka; // ambient color
@@ -27,19 +82,17 @@ struct MaterialMap {
     std::unordered_map<std::string, Material> materials;
 };
 
-MaterialMap loadMTL(auto& stream) {
+static MaterialMap loadMTL(std::string_view text) {
     MaterialMap result;
     std::string cur;
 
-    std::string line;
-    while (std::getline(stream, line)) {
+    while (!text.empty()) {
+        auto line = nextLine(text);
         if (line.starts_with("#")) continue;
-        std::stringstream ss{line};
-        std::string cmd;
-        ss >> cmd;
+        auto cmd = nextToken(line);
 
         if (cmd == "newmtl") {
-            ss >> cur;
+            parseValue(line, cur);
             continue;
         }
 
@@ -67,80 +120,257 @@ struct VertexData {
     glm::vec3 bitangent;
 };
 
+// a contiguous range of SceneObject::indices that is culled as a whole
+struct Meshlet {
+    unsigned indexOffset;
+    unsigned indexCount;
+    glm::vec3 center;
+    float radius;
+    NormalCone cone;
+};
+
 struct SceneObject {
     std::vector<VertexData> vertices;
     std::vector<unsigned> indices;
+    std::vector<Meshlet> meshlets; // filled by buildSceneMeshlets
     Material material;
 };
 
 struct Scene {
     std::unordered_map<std::string, SceneObject> objects;
+    size_t cornerCount = 0; // face corners in the source, i.e. vertices before welding
 };
 
-Scene loadOBJ(auto& stream, const MaterialMap& materials) {
-    Scene result;
-    std::vector<glm::vec3> v, vt, vn;
+// Faces are kept as raw (vi, vti, vni) corners while chunks are parsed, because
+// OBJ indices are global and may point into vertices of any earlier chunk.
+struct OBJSegment {
     std::string material;
+    bool inherited; // continues whatever material the previous chunk ended with
+    bool touched;   // the serial parser would have created objects[material] here
+    size_t faceBegin, faceEnd;
+    size_t cornerBegin;
+    size_t cornerCount = 0;
+    size_t indexCount = 0;
+};
+
+struct OBJChunk {
+    std::vector<glm::vec3> v, vt, vn;
+    std::vector<glm::ivec3> corners;
+    std::vector<unsigned> faces; // corners per face
+    std::vector<OBJSegment> segments;
+};
 
-    std::string line;
-    while (std::getline(stream, line)) {
+static OBJChunk parseOBJChunk(std::string_view text) {
+    OBJChunk chunk;
+    chunk.segments.push_back({.material = {}, .inherited = true, .touched = false, .faceBegin = 0, .faceEnd = 0, .cornerBegin = 0});
+
+    while (!text.empty()) {
+        auto line = nextLine(text);
         if (line.starts_with("#")) continue;
-        std::stringstream ss{line};
-        std::string cmd;
-        ss >> cmd;
+        auto cmd = nextToken(line);
 
         if (cmd == "usemtl") {
-            ss >> material;
-            result.objects[material].material = materials.materials.at(material);
+            auto& seg = chunk.segments.emplace_back();
+            parseValue(line, seg.material);
+            seg.inherited = false;
+            seg.touched = true;
+            seg.faceBegin = seg.faceEnd = chunk.faces.size();
+            seg.cornerBegin = chunk.corners.size();
             continue;
         }
 
-        auto& obj = result.objects[material];
+        auto& seg = chunk.segments.back();
+        seg.touched = true;
 
-        PARSE_VEC3_2("v", v.emplace_back());
-        PARSE_VEC3_2("vt", vt.emplace_back());
-        PARSE_VEC3_2("vn", vn.emplace_back());
+        PARSE_VEC3_2("v", chunk.v.emplace_back(0.0f));
+        PARSE_VEC3_2("vt", chunk.vt.emplace_back(0.0f));
+        PARSE_VEC3_2("vn", chunk.vn.emplace_back(0.0f));
 
         if (cmd == "f") {
-            std::string face;
-            unsigned first = obj.vertices.size();
             unsigned count = 0;
-            while (ss >> face) {
-                int vi, vti, vni;
-                char dummy;
-                std::stringstream fs{face};
-                fs >> vi >> dummy >> vti >> dummy >> vni;
-                --vi, --vti, --vni;
-
-                auto& vertex = obj.vertices.emplace_back();
-                vertex.position = v[vi];
-                vertex.texcoord = { vt[vti].x, vt[vti].y };
-                vertex.normal = vn[vni];
-
+            for (auto face = nextToken(line); !face.empty(); face = nextToken(line)) {
+                auto& corner = chunk.corners.emplace_back();
+                parseFace(face, corner.x, corner.y, corner.z);
                 ++count;
             }
+            chunk.faces.push_back(count);
+            seg.faceEnd = chunk.faces.size();
+            seg.cornerCount += count;
+            if (count > 2) seg.indexCount += 3 * (count - 2);
+        }
+    }
+
+    return chunk;
+}
+
+struct OBJSegmentRef {
+    const OBJChunk* chunk;
+    const OBJSegment* seg;
+};
+
+struct OBJCornerHash {
+    size_t operator()(const glm::ivec3& c) const noexcept {
+        uint64_t h = uint32_t(c.x);
+        h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(c.y);
+        h = h * 0x9E3779B97F4A7C15ull ^ uint32_t(c.z);
+        return h ^ (h >> 29);
+    }
+};
+
+static glm::vec3 anyPerpendicular(glm::vec3 n) {
+    return glm::abs(n.x) < 0.9f ? glm::cross(n, glm::vec3{1.0f, 0.0f, 0.0f}) : glm::cross(n, glm::vec3{0.0f, 1.0f, 0.0f});
+}
+
+// turns the accumulated tangent and bitangent into an orthonormal frame around the normal
+static void orthonormalizeTangentFrame(VertexData& vertex) {
+    if (glm::dot(vertex.normal, vertex.normal) == 0.0f) {
+        if (glm::dot(vertex.tangent, vertex.tangent) > 0.0f) vertex.tangent = glm::normalize(vertex.tangent);
+        if (glm::dot(vertex.bitangent, vertex.bitangent) > 0.0f) vertex.bitangent = glm::normalize(vertex.bitangent);
+        return;
+    }
+
+    auto n = glm::normalize(vertex.normal);
+    auto t = vertex.tangent - n * glm::dot(n, vertex.tangent);
+    if (glm::dot(t, t) < 1e-12f) t = anyPerpendicular(n);
+    t = glm::normalize(t);
+
+    auto b = glm::cross(n, t);
+    vertex.tangent = t;
+    vertex.bitangent = glm::dot(b, vertex.bitangent) < 0.0f ? -b : b;
+}
+
+// Builds one object from its segments. Corners with identical (v, vt, vn) share
+// a vertex, and every vertex gets the sum of the tangent frames of its triangles.
+static void resolveOBJObject(SceneObject& obj, const std::vector<OBJSegmentRef>& segments,
+                             const std::vector<glm::vec3>& v,
+                             const std::vector<glm::vec3>& vt,
+                             const std::vector<glm::vec3>& vn) {
+    size_t cornerCount = 0, indexCount = 0;
+    for (const auto& ref : segments) {
+        cornerCount += ref.seg->cornerCount;
+        indexCount += ref.seg->indexCount;
+    }
+
+    std::unordered_map<glm::ivec3, unsigned, OBJCornerHash> welded;
+    welded.reserve(cornerCount);
+    obj.vertices.reserve(cornerCount);
+    obj.indices.reserve(indexCount);
+
+    std::vector<unsigned> face;
+    for (const auto& [chunk, seg] : segments) {
+        size_t corner = seg->cornerBegin;
+        for (size_t f = seg->faceBegin; f < seg->faceEnd; ++f) {
+            unsigned count = chunk->faces[f];
+            face.clear();
+            for (unsigned i = 0; i < count; ++i) {
+                const auto& c = chunk->corners[corner++];
+                auto [it, inserted] = welded.try_emplace(c, obj.vertices.size());
+                if (inserted) {
+                    auto& vertex = obj.vertices.emplace_back();
+                    vertex.position = v[c.x];
+                    if (c.y >= 0) vertex.texcoord = { vt[c.y].x, vt[c.y].y };
+                    if (c.z >= 0) vertex.normal = vn[c.z];
+                }
+                face.push_back(it->second);
+            }
 
-            for (int i = 2; i < count; ++i) {
-                obj.indices.push_back(first);
-                obj.indices.push_back(first + i - 1);
-                obj.indices.push_back(first + i);
+            for (unsigned i = 2; i < count; ++i) {
+                obj.indices.push_back(face[0]);
+                obj.indices.push_back(face[i - 1]);
+                obj.indices.push_back(face[i]);
 
-                // calculate tangents and bitangents
-                auto& v1 = obj.vertices[first];
-                auto& v2 = obj.vertices[first + i - 1];
-                auto& v3 = obj.vertices[first + i];
+                // accumulate tangents and bitangents
+                auto& v1 = obj.vertices[face[0]];
+                auto& v2 = obj.vertices[face[i - 1]];
+                auto& v3 = obj.vertices[face[i]];
 
                 auto edge1 = v2.position - v1.position;
                 auto edge2 = v3.position - v1.position;
                 auto duv1 = v2.texcoord - v1.texcoord;
                 auto duv2 = v3.texcoord - v1.texcoord;
 
-                float f = 1.0f / (duv1.x * duv2.y - duv2.x * duv1.y);
-                v1.tangent = v2.tangent = v3.tangent = f * (duv2.y * edge1 - duv1.y * edge2);
-                v1.bitangent = v2.bitangent = v3.bitangent = f * (-duv2.x * edge1 - duv1.x * edge2);
+                float det = duv1.x * duv2.y - duv2.x * duv1.y;
+                if (det == 0.0f || !std::isfinite(det)) continue;
+
+                float r = 1.0f / det;
+                auto tangent = r * (duv2.y * edge1 - duv1.y * edge2);
+                auto bitangent = r * (-duv2.x * edge1 - duv1.x * edge2);
+                for (auto* vertex : {&v1, &v2, &v3}) {
+                    vertex->tangent += tangent;
+                    vertex->bitangent += bitangent;
+                }
             }
         }
     }
 
+    for (auto& vertex : obj.vertices) {
+        orthonormalizeTangentFrame(vertex);
+    }
+}
+
+// Splits the file into line-aligned chunks parsed on `threads` workers. The
+// chunks are merged with prefix sums over their v/vt/vn counts and objects are
+// resolved in file order, so the result does not depend on the number of threads.
+static Scene loadOBJ(std::string_view text, const MaterialMap& materials, unsigned threads = 1) {
+    static const size_t MIN_CHUNK_SIZE = 1 << 16;
+
+    std::vector<std::string_view> pieces;
+    size_t chunkCount = std::clamp<size_t>(text.size() / MIN_CHUNK_SIZE, 1, std::max<size_t>(threads, 1) * 4);
+    size_t chunkSize = text.size() / chunkCount + 1;
+    while (!text.empty()) {
+        auto end = text.find('\n', std::min(chunkSize, text.size()) - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        pieces.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+
+    std::vector<OBJChunk> chunks(pieces.size());
+    parallelFor(chunks.size(), threads, [&](size_t i) {
+        chunks[i] = parseOBJChunk(pieces[i]);
+    });
+
+    // concatenate vertex attribute streams
+    std::vector<size_t> vOffset(chunks.size() + 1), vtOffset(chunks.size() + 1), vnOffset(chunks.size() + 1);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        vOffset[i + 1] = vOffset[i] + chunks[i].v.size();
+        vtOffset[i + 1] = vtOffset[i] + chunks[i].vt.size();
+        vnOffset[i + 1] = vnOffset[i] + chunks[i].vn.size();
+    }
+
+    std::vector<glm::vec3> v(vOffset.back()), vt(vtOffset.back()), vn(vnOffset.back());
+    parallelFor(chunks.size(), threads, [&](size_t i) {
+        std::copy(chunks[i].v.begin(), chunks[i].v.end(), v.begin() + vOffset[i]);
+        std::copy(chunks[i].vt.begin(), chunks[i].vt.end(), vt.begin() + vtOffset[i]);
+        std::copy(chunks[i].vn.begin(), chunks[i].vn.end(), vn.begin() + vnOffset[i]);
+    });
+
+    // gather every object's segments in file order
+    Scene result;
+    std::vector<std::pair<SceneObject*, std::vector<OBJSegmentRef>>> objects;
+    std::unordered_map<SceneObject*, size_t> objectIndex;
+    std::string material;
+    for (const auto& chunk : chunks) {
+        for (const auto& seg : chunk.segments) {
+            if (!seg.inherited) material = seg.material;
+            if (!seg.touched) continue;
+
+            auto& obj = result.objects[material];
+            if (!seg.inherited) {
+                // a material the MTL does not define, or no MTL at all, gets the defaults
+                auto found = materials.materials.find(material);
+                obj.material = found != materials.materials.end() ? found->second : Material{};
+            }
+
+            auto [it, inserted] = objectIndex.try_emplace(&obj, objects.size());
+            if (inserted) objects.emplace_back(&obj, std::vector<OBJSegmentRef>{});
+            objects[it->second].second.push_back({&chunk, &seg});
+            result.cornerCount += seg.cornerCount;
+        }
+    }
+
+    parallelFor(objects.size(), threads, [&](size_t i) {
+        resolveOBJObject(*objects[i].first, objects[i].second, v, vt, vn);
+    });
+
     return result;
 }
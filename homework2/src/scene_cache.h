@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "scene.h"
+#include "mapped_file.h"
+
+// Cooked scene: the output of loadOBJ dumped as-is, so that later runs can
+// mmap it and hand the vertex/index arrays straight to glBufferData.
+//
+// layout: SceneCacheHeader, then per object
+//   u32 name length, name, Ka Kd Ks Ns (10 floats), 5 x (u32 length, texture name),
+//   u64 vertex count, u64 index count, u64 meshlet count, padding to 8,
+//   vertices, indices, padding to 8, meshlets, padding to 8
+
+static const char SCENE_CACHE_MAGIC[8] = {'H', 'W', '2', 'S', 'C', 'E', 'N', 'E'};
+static const uint32_t SCENE_CACHE_VERSION = 4;
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t objectCount;
+    SourceStamp obj;
+    SourceStamp mtl;
+};
+
+struct CookedSceneObject {
+    std::span<const VertexData> vertices;
+    std::span<const unsigned> indices;
+    std::span<const Meshlet> meshlets;
+    Material material;
+};
+
+struct CookedScene {
+    std::unique_ptr<MappedFile> file;
+    std::unordered_map<std::string, CookedSceneObject> objects;
+};
+
+struct SceneCacheReader {
+    std::string_view data;
+    size_t pos = 0;
+
+    bool has(size_t n) const { return data.size() - pos >= n; }
+
+    template <typename T>
+    bool read(T& out) {
+        if (!has(sizeof(T))) return false;
+        std::memcpy(&out, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool read(std::string& out) {
+        uint32_t len;
+        if (!read(len) || !has(len)) return false;
+        out.assign(data.data() + pos, len);
+        pos += len;
+        return true;
+    }
+
+    template <typename T>
+    bool read(std::span<const T>& out, uint64_t count) {
+        if (count > (data.size() - pos) / sizeof(T)) return false;
+        out = {reinterpret_cast<const T*>(data.data() + pos), count};
+        pos += count * sizeof(T);
+        return true;
+    }
+
+    void align() { pos = std::min(data.size(), (pos + 7) & ~size_t{7}); }
+};
+
+static std::optional<CookedScene> loadSceneCache(const std::string& path, SourceStamp obj, SourceStamp mtl) {
+    if (!std::filesystem::exists(path)) return std::nullopt;
+
+    CookedScene result;
+    result.file = std::make_unique<MappedFile>(path);
+    SceneCacheReader in{result.file->view()};
+
+    SceneCacheHeader header;
+    if (!in.read(header)) return std::nullopt;
+    if (std::memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0) return std::nullopt;
+    if (header.version != SCENE_CACHE_VERSION) return std::nullopt;
+    if (header.obj != obj || header.mtl != mtl) return std::nullopt;
+
+    for (uint32_t i = 0; i < header.objectCount; ++i) {
+        std::string name;
+        CookedSceneObject cooked;
+        auto& M = cooked.material;
+        uint64_t vertexCount, indexCount, meshletCount;
+        bool ok = in.read(name)
+            && in.read(M.Ka) && in.read(M.Kd) && in.read(M.Ks) && in.read(M.Ns)
+            && in.read(M.map_Ka) && in.read(M.map_Kd) && in.read(M.map_Ks) && in.read(M.map_d) && in.read(M.norm)
+            && in.read(vertexCount) && in.read(indexCount) && in.read(meshletCount);
+        if (!ok) return std::nullopt;
+        in.align();
+        if (!in.read(cooked.vertices, vertexCount) || !in.read(cooked.indices, indexCount)) return std::nullopt;
+        in.align();
+        if (!in.read(cooked.meshlets, meshletCount)) return std::nullopt;
+        in.align();
+        result.objects.emplace(std::move(name), std::move(cooked));
+    }
+
+    return result;
+}
+
+struct SceneCacheWriter {
+    std::ofstream out;
+    size_t pos = 0;
+
+    void write(const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+        pos += size;
+    }
+
+    template <typename T>
+    void write(const T& value) { write(&value, sizeof(T)); }
+
+    void write(const std::string& value) {
+        write(static_cast<uint32_t>(value.size()));
+        write(value.data(), value.size());
+    }
+
+    void align() {
+        static const char zeros[8] = {};
+        write(zeros, (8 - pos % 8) % 8);
+    }
+};
+
+// failures are not fatal: the scene is simply parsed again next time
+static bool writeSceneCache(const std::string& path, const Scene& scene, SourceStamp obj, SourceStamp mtl) {
+    auto tmp = path + ".tmp";
+    {
+        SceneCacheWriter w{std::ofstream{tmp, std::ios::binary | std::ios::trunc}};
+        if (!w.out) return false;
+
+        SceneCacheHeader header{};
+        std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+        header.version = SCENE_CACHE_VERSION;
+        header.objectCount = scene.objects.size();
+        header.obj = obj;
+        header.mtl = mtl;
+        w.write(header);
+
+        for (const auto& [name, o] : scene.objects) {
+            const auto& M = o.material;
+            w.write(name);
+            w.write(M.Ka); w.write(M.Kd); w.write(M.Ks); w.write(M.Ns);
+            w.write(M.map_Ka); w.write(M.map_Kd); w.write(M.map_Ks); w.write(M.map_d); w.write(M.norm);
+            w.write(static_cast<uint64_t>(o.vertices.size()));
+            w.write(static_cast<uint64_t>(o.indices.size()));
+            w.write(static_cast<uint64_t>(o.meshlets.size()));
+            w.align();
+            w.write(o.vertices.data(), o.vertices.size() * sizeof(o.vertices[0]));
+            w.write(o.indices.data(), o.indices.size() * sizeof(o.indices[0]));
+            w.align();
+            w.write(o.meshlets.data(), o.meshlets.size() * sizeof(o.meshlets[0]));
+            w.align();
+        }
+
+        if (!w.out) return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "clusters.h"
+#include "gl_objects.h"
+#include "shaders.h"
+#include "uniform_blocks.h"
+
+// one #define of the scene shaders per bit
+enum ShaderFeature : unsigned {
+    FEATURE_KA = 1 << 0,
+    FEATURE_KD = 1 << 1,
+    FEATURE_D = 1 << 2, // alpha-tested
+    FEATURE_NORM = 1 << 3,
+    FEATURE_KS = 1 << 4,
+    FEATURE_DEPTH_ONLY = 1 << 5, // SHADOW_FRAGMENT_SHADER instead of SCENE_FRAGMENT_SHADER
+    FEATURE_GBUFFER = 1 << 6,
+    FEATURE_DEFERRED_LIGHTING = 1 << 7, // the fullscreen lighting pass, no material features
+};
+
+static const char* SHADER_FEATURE_DEFINES[] = {"HAS_KA", "HAS_KD", "HAS_D", "HAS_NORM", "HAS_KS", "DEPTH_ONLY", "GBUFFER", "DEFERRED_LIGHTING"};
+
+// Scene programs compiled on first use and cached by feature bitmask. Every
+// program gets its sampler units and uniform block bindings at link time, so
+// a pass only has to select it.
+struct ShaderPermutations {
+    struct Permutation {
+        Program program;
+        unsigned index; // in compilation order, for the program field of DrawKey
+    };
+
+    bool packedVertices = true;
+    std::unordered_map<unsigned, Permutation> permutations;
+
+    // binds the program as a side effect when it has to be compiled
+    const Permutation& get(unsigned features) {
+        if (auto it = permutations.find(features); it != permutations.end()) {
+            return it->second;
+        }
+
+        std::vector<std::string> defines;
+        if (packedVertices) defines.push_back("PACKED_VERTICES");
+        for (unsigned bit = 0; bit < std::size(SHADER_FEATURE_DEFINES); ++bit) {
+            if (features & (1u << bit)) defines.push_back(SHADER_FEATURE_DEFINES[bit]);
+        }
+        defines.push_back("MAX_SHADOWED_LIGHTS " + std::to_string(MAX_SHADOWED_LIGHTS));
+        defines.push_back("CLUSTERS_X " + std::to_string(CLUSTERS_X));
+        defines.push_back("CLUSTERS_Y " + std::to_string(CLUSTERS_Y));
+        defines.push_back("CLUSTERS_Z " + std::to_string(CLUSTERS_Z));
+        defines.push_back("MAX_MATERIALS " + std::to_string(MAX_MATERIALS));
+        defines.push_back("MAX_CASCADES " + std::to_string(MAX_CASCADES));
+        defines.push_back("MAX_TEXTURE_ARRAYS " + std::to_string(MAX_TEXTURE_ARRAYS));
+
+        const char* vertex = SCENE_VERTEX_SHADER;
+        std::string fragment = withShading(withMaterials(SCENE_FRAGMENT_SHADER));
+        if (features & FEATURE_DEPTH_ONLY) {
+            fragment = withMaterials(SHADOW_FRAGMENT_SHADER);
+        } else if (features & FEATURE_DEFERRED_LIGHTING) {
+            vertex = FULLSCREEN_VERTEX_SHADER;
+            fragment = withShading(DEFERRED_LIGHTING_FRAGMENT_SHADER);
+        }
+        Program program = createProgram(
+            createShader(GL_VERTEX_SHADER, withDefines(vertex, defines)),
+            createShader(GL_FRAGMENT_SHADER, withDefines(fragment, defines))
+        );
+
+        program.bindUniformBlock("Lights", LIGHTS_BINDING);
+        program.bindUniformBlock("Materials", MATERIALS_BINDING);
+        program.bindUniformBlock("Frame", FRAME_BINDING);
+        program.bindUniformBlock("ShadowAtlas", SHADOW_ATLAS_BINDING);
+
+        // material arrays and the G-buffer share the first units, no program samples both
+        glUseProgram(program);
+        std::array<GLint, MAX_TEXTURE_ARRAYS> arrayUnits;
+        std::iota(arrayUnits.begin(), arrayUnits.end(), 0);
+        glUniform1iv(program.location("sampler_arrays"), arrayUnits.size(), arrayUnits.data());
+        program.setUniform("sampler_gbuffer_albedo", 0);
+        program.setUniform("sampler_gbuffer_normal", 1);
+        program.setUniform("sampler_gbuffer_ambient", 2);
+        program.setUniform("sampler_gbuffer_depth", 3);
+        program.setUniform("sampler_shadow", 11);
+        program.setUniform("sampler_atlas", 12);
+        program.setUniform("sampler_lights", 13);
+        program.setUniform("sampler_clusters", 14);
+        program.setUniform("sampler_cluster_lights", 15);
+
+        unsigned index = permutations.size();
+        return permutations.emplace(features, Permutation{std::move(program), index}).first->second;
+    }
+};
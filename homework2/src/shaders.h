@@ -1,142 +1,395 @@
 #pragma once
 
+#include <string>
+
 static const char* SCENE_VERTEX_SHADER = R"(
 #version 330 core
 
+#ifdef PACKED_VERTICES
+layout (location = 0) in vec3 in_position;  // unorm16 inside the scene bounds
+layout (location = 1) in vec2 in_texcoord;  // half float
+layout (location = 2) in vec4 in_qtangent;  // snorm16 quaternion, w sign is the handedness
+
+vec3 quat_rotate(vec4 q, vec3 v) {
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+#else
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec2 in_texcoord;
 layout (location = 2) in vec3 in_normal;
 layout (location = 3) in vec3 in_tangent;
 layout (location = 4) in vec3 in_bitangent;
+#endif
+
+// mirrors FrameBlock, must match SCENE_FRAGMENT_SHADER
+layout (std140) uniform Frame {
+    mat4 view;
+    mat4 projection;
+    mat4 shadow_transforms[MAX_CASCADES];
+    vec4 cascade_splits;
+    vec4 cascade_bias;
+    int cascade_count;
+    vec3 camera_position;
+    vec3 position_offset;
+    vec3 position_scale;
+};
 
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 shadow_transform;
-
-out vec3 position;
 out vec2 texcoord;
+invariant gl_Position; // the depth pre-pass and the GL_EQUAL lighting pass must agree bit for bit
+#ifndef DEPTH_ONLY
+out vec3 position;
 out vec3 normal;
-out vec4 shadow_position;
 out mat3 TBN;
+#endif
 
 void main() {
-    gl_Position = projection * view * vec4(in_position, 1.0);
-
+#ifdef PACKED_VERTICES
+    vec3 world_position = position_offset + in_position * position_scale;
+    vec4 q = normalize(in_qtangent);
+    vec3 T = quat_rotate(q, vec3(1.0, 0.0, 0.0));
+    vec3 B = quat_rotate(q, vec3(0.0, 1.0, 0.0)) * (q.w < 0.0 ? -1.0 : 1.0);
+    vec3 N = quat_rotate(q, vec3(0.0, 0.0, 1.0));
+#else
+    vec3 world_position = in_position;
     vec3 T = normalize(in_tangent);
     vec3 B = normalize(in_bitangent);
     vec3 N = normalize(in_normal);
-    TBN = mat3(T, B, N);
-
-    position = in_position;
+#endif
+    gl_Position = projection * view * vec4(world_position, 1.0);
     texcoord = vec2(in_texcoord.x, 1.0 - in_texcoord.y);
-    normal = in_normal;
-    shadow_position = shadow_transform * vec4(in_position, 1.0);
+
+#ifndef DEPTH_ONLY
+    TBN = mat3(T, B, N);
+    position = world_position;
+    normal = N;
+#endif
 }
 )";
 
-static const char* SCENE_FRAGMENT_SHADER = R"(
-#version 330 core
+// Lighting shared by SCENE_FRAGMENT_SHADER and DEFERRED_LIGHTING_FRAGMENT_SHADER,
+// spliced in right after their #version line by withShading
+static const char* SHADING_SHADER = R"(
+uniform sampler2DArrayShadow sampler_shadow;
+uniform sampler2DShadow sampler_atlas;
+uniform samplerBuffer sampler_lights;          // four texels per light, see LightBlock
+uniform usamplerBuffer sampler_clusters;       // (offset, count) per cluster
+uniform usamplerBuffer sampler_cluster_lights; // light indices
+
+// mirrors FrameBlock, must match SCENE_VERTEX_SHADER
+layout (std140) uniform Frame {
+    mat4 view;
+    mat4 projection;
+    mat4 shadow_transforms[MAX_CASCADES];
+    vec4 cascade_splits;
+    vec4 cascade_bias;
+    int cascade_count;
+    vec3 camera_position;
+    vec3 position_offset;
+    vec3 position_scale;
+};
 
-uniform bool is_drawing_shadows;
+// mirrors LightBlock
+struct Light {
+    vec3 position;
+    bool directional;
+    vec3 diffuse;
+    int shadow_slot;
+    vec3 specular;
+    vec3 attenuation;
+};
 
-in vec3 position;
-in vec2 texcoord;
-in vec3 normal;
-in vec4 shadow_position;
-in mat3 TBN;
+Light fetch_light(int index) {
+    vec4 a = texelFetch(sampler_lights, index * 4);
+    vec4 b = texelFetch(sampler_lights, index * 4 + 1);
+    return Light(a.xyz, a.w != 0.0, b.xyz, int(b.w), texelFetch(sampler_lights, index * 4 + 2).xyz, texelFetch(sampler_lights, index * 4 + 3).xyz);
+}
 
-out vec4 out_color;
+// mirrors LightsBlock
+layout (std140) uniform Lights {
+    vec2 viewport_size;
+    float cluster_near;
+    float cluster_scale;
+};
 
-uniform sampler2D sampler_shadow;
+// same mapping as ClusterGrid
+int cluster_index(vec3 position) {
+    ivec2 tile = clamp(ivec2(gl_FragCoord.xy / viewport_size * vec2(CLUSTERS_X, CLUSTERS_Y)), ivec2(0), ivec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+    float depth = -(view * vec4(position, 1.0)).z;
+    int slice = depth <= cluster_near ? 0 : min(int(log(depth / cluster_near) * cluster_scale), CLUSTERS_Z - 1);
+    return (slice * CLUSTERS_Y + tile.y) * CLUSTERS_X + tile.x;
+}
 
-uniform sampler2D sampler_Ka;
-uniform vec3 uniform_Ka;
-uniform bool has_Ka;
+// mirrors ShadowAtlasBlock
+layout (std140) uniform ShadowAtlas {
+    mat4 face_transforms[MAX_SHADOWED_LIGHTS * 6];
+    vec4 face_rects[MAX_SHADOWED_LIGHTS * 6];
+    vec4 atlas_lights[MAX_SHADOWED_LIGHTS];
+};
 
-uniform sampler2D sampler_Kd;
-uniform vec3 uniform_Kd;
-uniform bool has_Kd;
+float get_shadow(vec3 position) {
+    float depth = -(view * vec4(position, 1.0)).z;
+    int cascade = 0;
+    while (cascade < cascade_count - 1 && depth > cascade_splits[cascade]) ++cascade;
+    if (depth > cascade_splits[cascade]) return 0.0;
 
-uniform sampler2D sampler_d;
-uniform bool has_d;
+    vec4 shadow_position = shadow_transforms[cascade] * vec4(position, 1.0);
+    vec3 coords = shadow_position.xyz / shadow_position.w * 0.5 + 0.5;
+    if (any(lessThan(coords, vec3(0.0))) || any(greaterThan(coords, vec3(1.0)))) return 0.0;
 
-uniform sampler2D sampler_norm;
-uniform bool has_norm;
+    // 2x2 PCF from the hardware comparison
+    return 1.0 - texture(sampler_shadow, vec4(coords.xy, float(cascade), coords.z - cascade_bias[cascade]));
+}
 
-uniform sampler2D sampler_Ks;
-uniform vec3 uniform_Ks;
-uniform bool has_Ks;
+float get_point_shadow(Light light, vec3 position) {
+    if (light.shadow_slot < 0) return 0.0;
 
-uniform float Ns;
+    // the major axis picks the cube face, in the order +X -X +Y -Y +Z -Z
+    vec3 d = position - light.position;
+    vec3 a = abs(d);
+    int face = a.x >= a.y && a.x >= a.z ? (d.x > 0.0 ? 0 : 1) : a.y >= a.z ? (d.y > 0.0 ? 2 : 3) : (d.z > 0.0 ? 4 : 5);
+    int index = light.shadow_slot * 6 + face;
 
-uniform vec3 camera_position;
+    // moving the receiver toward the light by a couple of texels stands in for a depth bias
+    vec4 shadow_position = face_transforms[index] * vec4(position - d * atlas_lights[light.shadow_slot].y, 1.0);
+    vec3 coords = shadow_position.xyz / shadow_position.w;
+    if (coords.z > 1.0) return 0.0;
+    coords.xy = clamp(coords.xy, face_rects[index].xy, face_rects[index].zw);
+    return 1.0 - texture(sampler_atlas, coords);
+}
 
-struct Light {
-    vec3 position;
-    vec3 diffuse;
-    vec3 specular;
-    vec3 attenuation;
-    bool directional;
+// ambient plus every light of the cluster; Ks is a single channel
+vec3 shade(vec3 position, vec3 norm, vec3 Ka, vec3 Kd, float Ks, float Ns) {
+    vec3 color = Ka * 0.1;
+    vec3 camera_direction = normalize(camera_position - position);
+
+    // only the lights that reach this fragment's cluster
+    uvec2 range = texelFetch(sampler_clusters, cluster_index(position)).xy;
+    for (uint n = 0u; n < range.y; ++n) {
+        Light light = fetch_light(int(texelFetch(sampler_cluster_lights, int(range.x + n)).x));
+        float shadow = light.directional ? get_shadow(position) : get_point_shadow(light, position);
+        vec3 direction = light.directional ? light.position : normalize(light.position - position);
+        float distance = light.directional ? 0.0 : length(position - light.position);
+        float factor = max(dot(direction, norm), 0.0);
+        float intensity = 1.0 / dot(vec3(1.0, distance, distance * distance), light.attenuation);
+
+        color += Kd * light.diffuse * factor * intensity * (1.0 - shadow);
+
+        vec3 reflect_direction = reflect(-direction, norm);
+        float spec = pow(max(dot(camera_direction, reflect_direction), 0.0), Ns);
+
+        color += Ks * light.specular * spec * intensity * (1.0 - shadow);
+    }
+    return color;
+}
+
+vec2 sign_not_zero(vec2 v) {
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// unit vector to [0, 1]^2 and back, octahedral mapping
+vec2 encode_normal(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 p = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+    return p * 0.5 + 0.5;
+}
+
+vec3 decode_normal(vec2 e) {
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+    return normalize(n);
+}
+
+// Ns up to 2047 in [0, 1], log spaced
+float encode_shininess(float Ns) {
+    return clamp(log2(Ns + 1.0) / 11.0, 0.0, 1.0);
+}
+
+float decode_shininess(float e) {
+    return exp2(e * 11.0) - 1.0;
+}
+)";
+
+// Material maps shared by SCENE_FRAGMENT_SHADER and SHADOW_FRAGMENT_SHADER,
+// spliced in by withMaterials. Every map is a layer of one of the texture
+// arrays, see TextureManager.
+static const char* MATERIAL_SHADER = R"(
+uniform sampler2DArray sampler_arrays[MAX_TEXTURE_ARRAYS];
+
+// mirrors MaterialBlock
+struct Material {
+    vec4 Ka;
+    vec4 Kd;
+    vec4 Ks; // w: Ns
+    uvec4 maps;
 };
 
-#define MAX_LIGHTS 16
-uniform Light lights[MAX_LIGHTS];
-uniform int lights_size;
+layout (std140) uniform Materials {
+    Material materials[MAX_MATERIALS];
+};
 
-float get_shadow() {
-    vec3 coords = shadow_position.xyz / shadow_position.w;
-    coords = coords * 0.5 + 0.5;
-    bool in_shadow_texture = (coords.x > 0.0) && (coords.x < 1.0) && (coords.y > 0.0) && (coords.y < 1.0) && (coords.z > 0.0) && (coords.z < 1.0);
-    if (!in_shadow_texture) return 0.0;
+uniform int material_index;
+
+const int MAP_KA = 0;
+const int MAP_KD = 1;
+const int MAP_D = 2;
+const int MAP_NORM = 3;
+const int MAP_KS = 4;
 
-    float closest_depth = texture(sampler_shadow, coords.xy).x;
-    float current_depth = coords.z;
-    float shadow = current_depth - 0.005 > closest_depth  ? 1.0 : 0.0;
-    return shadow;
+// textureLod at the level texture() would pick, but no finer than min_lod
+vec4 sample_clamped(sampler2DArray s, vec3 coords, vec2 dx, vec2 dy, float min_lod) {
+    vec2 size = vec2(textureSize(s, 0).xy);
+    float lod = 0.5 * log2(max(dot(dx * size, dx * size), dot(dy * size, dy * size)));
+    return textureLod(s, coords, max(lod, min_lod));
 }
 
-void main() {
-    if (is_drawing_shadows && !has_d) return;
+// One of the maps of the material, missing while it has none. GLSL 3.30
+// indexes sampler arrays by constants only; material_index keeps the
+// branches uniform. A layer without its finest levels has them clamped off.
+vec4 sample_map(Material material, int map, vec2 uv, vec4 missing) {
+    uint location = (material.maps[map / 2] >> uint(16 * (map % 2))) & 0xffffu;
+    float min_lod = float((material.maps.w >> uint(4 * map)) & 0xfu);
+    int array = int(location >> 12u);
+    vec3 coords = vec3(uv, float(location & 0xfffu));
+    vec2 dx = dFdx(uv), dy = dFdy(uv);
+#define SAMPLE_ARRAY(i) if (array == i) return min_lod == 0.0 ? texture(sampler_arrays[i], coords) : sample_clamped(sampler_arrays[i], coords, dx, dy, min_lod);
+    SAMPLE_ARRAY(0) SAMPLE_ARRAY(1) SAMPLE_ARRAY(2) SAMPLE_ARRAY(3) SAMPLE_ARRAY(4) SAMPLE_ARRAY(5)
+    SAMPLE_ARRAY(6) SAMPLE_ARRAY(7) SAMPLE_ARRAY(8) SAMPLE_ARRAY(9) SAMPLE_ARRAY(10)
+#undef SAMPLE_ARRAY
+    return missing;
+}
+)";
 
-    vec4 Ka = has_Ka ? vec4(pow(texture(sampler_Ka, texcoord).rgb, vec3(2.2)), 1.0) : vec4(uniform_Ka, 1.0);
+// inserts snippet right after the #version directive of source
+static std::string splice(std::string source, const char* snippet) {
+    auto pos = source.find("#version");
+    pos = pos == std::string::npos ? 0 : source.find('\n', pos) + 1;
+    return source.insert(pos, snippet);
+}
 
-    if (has_d) {
-        Ka.a = texture(sampler_d, texcoord).x;
-    }
+static std::string withShading(std::string source) {
+    return splice(std::move(source), SHADING_SHADER);
+}
 
-    if (Ka.a < 0.001) discard;
+static std::string withMaterials(std::string source) {
+    return splice(std::move(source), MATERIAL_SHADER);
+}
+
+// HAS_KA, HAS_KD, HAS_D, HAS_NORM and HAS_KS select which maps the material samples;
+// GBUFFER writes the surface out for DEFERRED_LIGHTING_FRAGMENT_SHADER instead of shading it
+static const char* SCENE_FRAGMENT_SHADER = R"(
+#version 330 core
+
+in vec3 position;
+in vec2 texcoord;
+in vec3 normal;
+in mat3 TBN;
 
-    if (is_drawing_shadows) return;
+#ifdef GBUFFER
+layout (location = 0) out vec4 out_albedo;  // Kd, Ks
+layout (location = 1) out vec4 out_normal;  // octahedral normal, encoded Ns
+layout (location = 2) out vec4 out_ambient; // Ka
+#else
+out vec4 out_color;
+#endif
 
-    vec4 Kd = has_Kd ? vec4(pow(texture(sampler_Kd, texcoord).rgb, vec3(2.2)), 1.0) : vec4(uniform_Kd, 1.0);
-    vec4 Ks = has_Ks ? texture(sampler_Ks, texcoord) : vec4(uniform_Ks, 1.0);
+void main() {
+    Material material = materials[material_index];
 
-    vec3 norm = normal;
+#ifdef HAS_KA
+    vec4 Ka = vec4(pow(sample_map(material, MAP_KA, texcoord, vec4(1.0)).rgb, vec3(2.2)), 1.0);
+#else
+    vec4 Ka = vec4(material.Ka.rgb, 1.0);
+#endif
 
-    if (has_norm) {
-        norm = texture(sampler_norm, texcoord).xyz * 2.0 - vec3(1.0, 1.0, 1.0);
-        norm = TBN * norm;
-    }
+#ifdef HAS_D
+    Ka.a = sample_map(material, MAP_D, texcoord, vec4(1.0)).x;
+    if (Ka.a < 0.001) discard;
+#endif
+
+#ifdef HAS_KD
+    vec4 Kd = vec4(pow(sample_map(material, MAP_KD, texcoord, vec4(1.0)).rgb, vec3(2.2)), 1.0);
+#else
+    vec4 Kd = vec4(material.Kd.rgb, 1.0);
+#endif
+
+#ifdef HAS_KS
+    vec4 Ks = sample_map(material, MAP_KS, texcoord, vec4(1.0));
+#else
+    vec4 Ks = vec4(material.Ks.rgb, 1.0);
+#endif
+
+    float Ns = material.Ks.w;
+
+#ifdef HAS_NORM
+    // two-channel normal map, z is implied by unit length
+    vec2 xy = sample_map(material, MAP_NORM, texcoord, vec4(0.5, 0.5, 1.0, 1.0)).xy * 2.0 - vec2(1.0, 1.0);
+    vec3 norm = TBN * vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
+#else
+    vec3 norm = normal;
+#endif
 
     norm = normalize(norm);
 
-    out_color = Ka * 0.1;
-    for (int i = 0; i < lights_size; ++i) {
-        float shadow = lights[i].directional ? get_shadow() : 0.0;
-        vec3 direction = lights[i].directional ? lights[i].position : normalize(lights[i].position - position);
-        float distance = lights[i].directional ? 0.0 : length(position - lights[i].position);
-        float factor = max(dot(direction, norm), 0.0);
-        float intensity = 1.0 / dot(vec3(1.0, distance, distance * distance), lights[i].attenuation);
+#ifdef GBUFFER
+    out_albedo = vec4(Kd.rgb, Ks.r);
+    out_normal = vec4(encode_normal(norm), encode_shininess(Ns), 0.0);
+    out_ambient = vec4(Ka.rgb, 1.0);
+#else
+    out_color = vec4(shade(position, norm, Ka.rgb, Kd.rgb, Ks.r, Ns), Ka.a);
+#endif
+}
+)";
 
-        out_color.rgb += Kd.rgb * lights[i].diffuse * factor * intensity * (1.0 - shadow);
+// one triangle over the whole viewport
+static const char* FULLSCREEN_VERTEX_SHADER = R"(
+#version 330 core
 
-        vec3 camera_direction = normalize(camera_position - position);
-        vec3 reflect_direction = reflect(-direction, norm);
-        float spec = pow(max(dot(camera_direction, reflect_direction), 0.0), Ns);
+void main() {
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
 
-        out_color.rgb += Ks.rrr * lights[i].specular * spec * intensity * (1.0 - shadow);
-    }
+// shades the G-buffer written by the GBUFFER scene shaders and restores its depth
+static const char* DEFERRED_LIGHTING_FRAGMENT_SHADER = R"(
+#version 330 core
+
+out vec4 out_color;
 
-    out_color.a = Ka.a;
+uniform sampler2D sampler_gbuffer_albedo;
+uniform sampler2D sampler_gbuffer_normal;
+uniform sampler2D sampler_gbuffer_ambient;
+uniform sampler2D sampler_gbuffer_depth;
+
+uniform mat4 inverse_view_projection;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(sampler_gbuffer_depth, pixel, 0).x;
+    if (depth == 1.0) discard;
+
+    vec4 albedo = texelFetch(sampler_gbuffer_albedo, pixel, 0);
+    vec4 normal = texelFetch(sampler_gbuffer_normal, pixel, 0);
+    vec3 ambient = texelFetch(sampler_gbuffer_ambient, pixel, 0).rgb;
+
+    vec4 ndc = vec4(gl_FragCoord.xy / viewport_size * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 position = inverse_view_projection * ndc;
+
+    out_color = vec4(shade(position.xyz / position.w, decode_normal(normal.xy), ambient, albedo.rgb, albedo.a, decode_shininess(normal.z)), 1.0);
+    gl_FragDepth = depth;
+}
+)";
+
+// depth-only pass; HAS_D makes it alpha-tested
+static const char* SHADOW_FRAGMENT_SHADER = R"(
+#version 330 core
+
+in vec2 texcoord;
+
+void main() {
+#ifdef HAS_D
+    if (sample_map(materials[material_index], MAP_D, texcoord, vec4(1.0)).x < 0.001) discard;
+#endif
 }
 )";
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <optional>
+#include <tuple>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+#include "camera.h"
+#include "gl_objects.h"
+#include "uniform_blocks.h"
+
+struct AtlasTile {
+    unsigned x = 0, y = 0, size = 0;
+};
+
+// Hands out square power-of-two tiles of a square atlas. Every node is either
+// a leaf (free or used) or split into four quadrants; releasing the last used
+// quadrant merges its parent back into a free leaf.
+struct QuadtreeAllocator {
+    struct Node {
+        unsigned x, y, size;
+        int children = -1; // index of the first of four consecutive nodes
+        bool used = false;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> freeBlocks; // children blocks of merged nodes, for reuse
+    size_t usedTexels = 0;
+
+    void reset(unsigned size) {
+        nodes = {Node{0, 0, size}};
+        freeBlocks.clear();
+        usedTexels = 0;
+    }
+
+    unsigned size() const {
+        return nodes.empty() ? 0 : nodes[0].size;
+    }
+
+    std::optional<AtlasTile> allocate(unsigned tileSize) {
+        if (nodes.empty()) return std::nullopt;
+        auto tile = allocate(0, tileSize);
+        if (tile) usedTexels += size_t(tileSize) * tileSize;
+        return tile;
+    }
+
+    void release(const AtlasTile& tile) {
+        if (release(0, tile)) usedTexels -= size_t(tile.size) * tile.size;
+    }
+
+private:
+    std::optional<AtlasTile> allocate(int index, unsigned tileSize) {
+        if (nodes[index].used || nodes[index].size < tileSize) return std::nullopt;
+        if (nodes[index].size == tileSize) {
+            if (nodes[index].children >= 0) return std::nullopt;
+            nodes[index].used = true;
+            return AtlasTile{nodes[index].x, nodes[index].y, tileSize};
+        }
+
+        if (nodes[index].children < 0) split(index);
+        for (int i = 0; i < 4; ++i) {
+            if (auto tile = allocate(nodes[index].children + i, tileSize)) return tile;
+        }
+        mergeIfEmpty(index);
+        return std::nullopt;
+    }
+
+    void split(int index) {
+        int first;
+        if (!freeBlocks.empty()) {
+            first = freeBlocks.back();
+            freeBlocks.pop_back();
+        } else {
+            first = nodes.size();
+            nodes.resize(nodes.size() + 4);
+        }
+        // nodes may have been reallocated, so the parent is read only after resize
+        Node parent = nodes[index];
+        unsigned half = parent.size / 2;
+        for (int i = 0; i < 4; ++i) {
+            nodes[first + i] = Node{parent.x + (i & 1) * half, parent.y + (i >> 1) * half, half};
+        }
+        nodes[index].children = first;
+    }
+
+    void mergeIfEmpty(int index) {
+        auto& node = nodes[index];
+        for (int i = 0; i < 4; ++i) {
+            const auto& child = nodes[node.children + i];
+            if (child.used || child.children >= 0) return;
+        }
+        freeBlocks.push_back(node.children);
+        node.children = -1;
+    }
+
+    bool release(int index, const AtlasTile& tile) {
+        auto& node = nodes[index];
+        if (node.size == tile.size) {
+            if (node.x != tile.x || node.y != tile.y || !node.used) return false;
+            node.used = false;
+            return true;
+        }
+        if (node.children < 0) return false;
+
+        unsigned half = node.size / 2;
+        int quadrant = (tile.x >= node.x + half ? 1 : 0) + (tile.y >= node.y + half ? 2 : 0);
+        if (!release(node.children + quadrant, tile)) return false;
+        mergeIfEmpty(index);
+        return true;
+    }
+};
+
+struct ShadowAtlasStats {
+    size_t shadowedLights = 0, droppedLights = 0; // dropped: visible, but no room left in the atlas
+    size_t tiles = 0, tilesRendered = 0;
+    size_t texelsUsed = 0, texelsTotal = 0;
+};
+
+// One face of the cube around a point light, in the GL cube map order +X -X +Y -Y +Z -Z
+static const glm::vec3 CUBE_FACE_DIRECTIONS[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+static const glm::vec3 CUBE_FACE_UPS[6] = {{0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+
+// distance at which 1 / (c + l d + q d²) drops below 1/256, i.e. stops showing up in 8-bit color
+static float lightRange(glm::vec3 attenuation) {
+    float c = attenuation.x - 256.0f, l = attenuation.y, q = attenuation.z;
+    if (c >= 0.0f) return 0.0f;
+    if (q <= 0.0f) return l > 0.0f ? -c / l : INFINITY;
+    return (-l + std::sqrt(l * l - 4.0f * q * c)) / (2.0f * q);
+}
+
+// fraction of the screen height covered by the sphere, 1 when the camera is inside it
+static float screenCoverage(const Camera& camera, glm::vec3 center, float radius) {
+    float distance = glm::length(center - camera.position);
+    if (distance <= radius) return 1.0f;
+    float tangent = radius / std::sqrt(distance * distance - radius * radius);
+    return std::min(tangent / std::tan(camera.fov * 0.5f), 1.0f);
+}
+
+// Point light shadows in one depth texture. Every shadowed light gets six
+// equal tiles, one per cube face, sized by how much of the screen the light
+// reaches; lights are served from the largest coverage down, halving the tile
+// size until they fit. A face is redrawn only when its tile or its light
+// moved, or when invalidate() reports moved geometry in the light's range.
+struct ShadowAtlas {
+    unsigned size = 4096;
+    unsigned minTile = 128, maxTile = 1024;
+    float zNear = 1.0f;
+
+    struct PointShadow {
+        glm::vec3 position{0.0f};
+        float range = 0.0f;
+        unsigned requested = 0; // face size asked for by the coverage
+        unsigned faceSize = 0;  // face size granted, 0 when the light is not shadowed
+        int slot = -1;          // in ShadowAtlasBlock
+        std::array<AtlasTile, 6> faces;
+        bool valid = false;
+    };
+
+    Texture depth;
+    Framebuffer framebuffer;
+    QuadtreeAllocator allocator;
+    std::vector<PointShadow> shadows; // by light index
+    ShadowAtlasStats stats;
+
+    void allocate() {
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        depth.label(GpuCategory::Shadows, "shadow atlas");
+        depth.allocated(size_t(size) * size * texelBytes(GL_DEPTH_COMPONENT24));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        allocator.reset(size);
+        shadows.clear();
+    }
+
+    // geometry inside the sphere moved, so the lights reaching it have to redraw
+    void invalidate(glm::vec3 center, float radius) {
+        for (auto& shadow : shadows) {
+            if (glm::length(shadow.position - center) <= shadow.range + radius) shadow.valid = false;
+        }
+    }
+
+    glm::mat4 faceView(const PointShadow& shadow, unsigned face) const {
+        return glm::lookAt(shadow.position, shadow.position + CUBE_FACE_DIRECTIONS[face], CUBE_FACE_UPS[face]);
+    }
+
+    glm::mat4 faceProjection(const PointShadow& shadow) const {
+        return glm::perspective(glm::half_pi<float>(), 1.0f, zNear, std::max(shadow.range, zNear * 2.0f));
+    }
+
+    // reassigns tiles for the current view; returns the (light, face) pairs that have to be redrawn
+    std::vector<std::pair<unsigned, unsigned>> update(const Camera& camera, const auto& lights) {
+        shadows.resize(lights.size());
+
+        std::vector<std::tuple<unsigned, float, float, unsigned>> wanted; // (face size, coverage, -distance, light)
+        for (unsigned i = 0; i < lights.size(); ++i) {
+            auto& shadow = shadows[i];
+            const auto& light = lights[i];
+            float range = light.directional ? 0.0f : lightRange(light.attenuation);
+            if (light.position != shadow.position || range != shadow.range) shadow.valid = false;
+            shadow.position = light.position;
+            shadow.range = range;
+
+            float coverage = shadow.range > 0.0f ? screenCoverage(camera, shadow.position, shadow.range) : 0.0f;
+            unsigned faceSize = 0;
+            if (coverage > 0.0f) {
+                faceSize = minTile;
+                while (faceSize * 2 <= maxTile && faceSize * 2 <= maxTile * coverage) faceSize *= 2;
+            }
+            // a light cut down by the budget keeps its smaller tiles until its request changes
+            if (faceSize != shadow.requested) release(shadow);
+            shadow.requested = faceSize;
+            if (faceSize != 0) wanted.emplace_back(faceSize, coverage, -glm::length(shadow.position - camera.position), i);
+        }
+
+        // the largest requests go first, so the atlas degrades from the lights that matter least;
+        // past MAX_SHADOWED_LIGHTS lights stay unshadowed, and give their tiles back before anyone claims
+        std::sort(wanted.begin(), wanted.end(), std::greater<>());
+        stats = {};
+        for (size_t rank = MAX_SHADOWED_LIGHTS; rank < wanted.size(); ++rank) {
+            release(shadows[std::get<3>(wanted[rank])]);
+            ++stats.droppedLights;
+        }
+        wanted.resize(std::min<size_t>(wanted.size(), MAX_SHADOWED_LIGHTS));
+        for (auto [faceSize, coverage, distance, i] : wanted) {
+            auto& shadow = shadows[i];
+            while (shadow.faceSize == 0 && faceSize >= minTile) {
+                if (!claim(shadow, faceSize)) faceSize /= 2;
+            }
+            if (shadow.faceSize == 0) ++stats.droppedLights;
+        }
+
+        std::vector<std::pair<unsigned, unsigned>> dirty;
+        for (unsigned i = 0; i < shadows.size(); ++i) {
+            auto& shadow = shadows[i];
+            shadow.slot = shadow.faceSize == 0 ? -1 : stats.shadowedLights;
+            if (shadow.faceSize == 0) continue;
+            ++stats.shadowedLights;
+            stats.tiles += 6;
+            if (shadow.valid) continue;
+            for (unsigned face = 0; face < 6; ++face) dirty.emplace_back(i, face);
+            shadow.valid = true;
+        }
+        stats.tilesRendered = dirty.size();
+        stats.texelsUsed = allocator.usedTexels;
+        stats.texelsTotal = size_t(size) * size;
+        return dirty;
+    }
+
+    ShadowAtlasBlock block() const {
+        ShadowAtlasBlock result{};
+        for (const auto& shadow : shadows) {
+            if (shadow.slot < 0) continue;
+            unsigned i = shadow.slot;
+            // 2 texels at the receiver's distance, for a 90 degree face
+            result.lights[i] = {1.0f, 4.0f / shadow.faceSize, 0.0f, 0.0f};
+            for (unsigned face = 0; face < 6; ++face) {
+                const auto& tile = shadow.faces[face];
+                glm::vec2 lo = glm::vec2{tile.x, tile.y} / float(size);
+                float extent = float(tile.size) / size;
+
+                // clip space to the tile, depth to [0, 1]
+                glm::mat4 toTile = glm::translate(glm::mat4{1.0f}, glm::vec3{lo + extent * 0.5f, 0.5f}) * glm::scale(glm::mat4{1.0f}, glm::vec3{extent * 0.5f, extent * 0.5f, 0.5f});
+                result.faceTransforms[i * 6 + face] = toTile * faceProjection(shadow) * faceView(shadow, face);
+
+                // half a texel in, so filtering never reads the neighbouring tile
+                float inset = 0.5f / size;
+                result.faceRects[i * 6 + face] = {lo.x + inset, lo.y + inset, lo.x + extent - inset, lo.y + extent - inset};
+            }
+        }
+        return result;
+    }
+
+private:
+    bool claim(PointShadow& shadow, unsigned faceSize) {
+        for (unsigned face = 0; face < 6; ++face) {
+            auto tile = allocator.allocate(faceSize);
+            if (!tile) {
+                for (unsigned j = 0; j < face; ++j) allocator.release(shadow.faces[j]);
+                return false;
+            }
+            shadow.faces[face] = *tile;
+        }
+        shadow.faceSize = faceSize;
+        shadow.valid = false;
+        return true;
+    }
+
+    void release(PointShadow& shadow) {
+        if (shadow.faceSize == 0) return;
+        for (const auto& tile : shadow.faces) allocator.release(tile);
+        shadow.faceSize = 0;
+        shadow.valid = false;
+    }
+};
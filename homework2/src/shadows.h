@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+#include "camera.h"
+#include "gl_objects.h"
+#include "uniform_blocks.h"
+
+// Splits [zNear, zFar] of the view depth into count slices, blending the
+// logarithmic and the uniform split by lambda ("practical split scheme",
+// Zhang et al. 2006). Returns the far end of every slice.
+static std::vector<float> practicalSplits(float zNear, float zFar, unsigned count, float lambda) {
+    std::vector<float> result(count);
+    for (unsigned i = 1; i <= count; ++i) {
+        float t = float(i) / count;
+        float logarithmic = zNear * std::pow(zFar / zNear, t);
+        float uniform = zNear + (zFar - zNear) * t;
+        result[i - 1] = lambda * logarithmic + (1.0f - lambda) * uniform;
+    }
+    return result;
+}
+
+struct CascadeFit {
+    glm::mat4 view;       // rotation into light space, the same for every cascade
+    glm::mat4 projection; // orthographic, snapped to whole texels
+    glm::vec3 eye;        // on the light side of the slice, for draw ordering
+    float texelSize;      // in world units
+    float depthRange;     // of the projection, in world units
+};
+
+// Orthographic light frustum around the view-depth slice [sliceNear, sliceFar].
+// The slice is bounded by a sphere computed in view space, so its size does not
+// change when the camera turns, and the sphere center is snapped to whole texels
+// in light space, so the matrix stays bit-identical while the camera moves
+// inside one texel. The depth range reaches back to the scene bounds, so that
+// casters outside the view still land in the map.
+static CascadeFit fitCascade(const Camera& camera, float sliceNear, float sliceFar, glm::vec3 toLight, glm::vec3 sceneLo, glm::vec3 sceneHi, unsigned resolution) {
+    float tanY = std::tan(camera.fov * 0.5f), tanX = tanY * camera.aspectRatio;
+    float diagonalNear = sliceNear * std::sqrt(tanX * tanX + tanY * tanY);
+    float diagonalFar = sliceFar * std::sqrt(tanX * tanX + tanY * tanY);
+
+    // the smallest sphere around the slice has its center on the view axis
+    float center = (sliceFar * sliceFar + diagonalFar * diagonalFar - sliceNear * sliceNear - diagonalNear * diagonalNear) / (2.0f * (sliceFar - sliceNear));
+    center = glm::clamp(center, sliceNear, sliceFar);
+    float radius = std::sqrt(std::max((sliceFar - center) * (sliceFar - center) + diagonalFar * diagonalFar, (center - sliceNear) * (center - sliceNear) + diagonalNear * diagonalNear));
+
+    CascadeFit result;
+    glm::vec3 up = std::abs(toLight.y) > 0.99f ? glm::vec3{1.0f, 0.0f, 0.0f} : glm::vec3{0.0f, 1.0f, 0.0f};
+    result.view = glm::lookAt(glm::vec3{0.0f}, -toLight, up);
+    result.texelSize = 2.0f * radius / resolution;
+
+    auto snap = [&](float v) { return std::floor(v / result.texelSize) * result.texelSize; };
+    glm::vec3 c{result.view * glm::vec4{camera.position + camera.direction() * center, 1.0f}};
+    c = {snap(c.x), snap(c.y), snap(c.z)};
+
+    // light space looks down -z, so the side facing the light has the largest z
+    float sceneTop = -INFINITY;
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner{i & 1 ? sceneHi.x : sceneLo.x, i & 2 ? sceneHi.y : sceneLo.y, i & 4 ? sceneHi.z : sceneLo.z};
+        sceneTop = std::max(sceneTop, (result.view * glm::vec4{corner, 1.0f}).z);
+    }
+    float zNear = -std::max(sceneTop, c.z + radius);
+    float zFar = -(c.z - radius);
+
+    result.projection = glm::ortho(c.x - radius, c.x + radius, c.y - radius, c.y + radius, zNear, zFar);
+    result.eye = glm::vec3{glm::inverse(result.view) * glm::vec4{c.x, c.y, -zNear, 1.0f}};
+    result.depthRange = zFar - zNear;
+    return result;
+}
+
+struct ShadowCascade {
+    glm::mat4 transform{1.0f}; // world to light clip space
+    float splitFar = 0.0f;     // view depth where this cascade ends
+    float bias = 0.0f;         // in depth buffer units
+    bool valid = false;        // the layer holds the depth seen through transform
+};
+
+// Cascades live in the layers of one depth texture array, sampled with
+// hardware comparison. The scene is static, so a cascade is only redrawn
+// when its snapped matrix changes; settings must be set before allocate().
+struct CascadedShadowMap {
+    unsigned cascadeCount = 4;
+    unsigned resolution = 2048;
+    float distance = 4000.0f; // beyond it nothing is shadowed
+    float splitLambda = 0.8f;
+
+    Texture depth;
+    Framebuffer framebuffer;
+    std::array<ShadowCascade, MAX_CASCADES> cascades;
+    glm::vec3 toLight{0.0f};
+
+    void allocate() {
+        if (cascadeCount == 0 || cascadeCount > MAX_CASCADES) {
+            throw std::runtime_error{"unsupported shadow cascade count"};
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, depth);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution, resolution, cascadeCount, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        depth.label(GpuCategory::Shadows, "shadow cascades");
+        depth.allocated(size_t(resolution) * resolution * cascadeCount * texelBytes(GL_DEPTH_COMPONENT24));
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        for (auto& cascade : cascades) cascade.valid = false;
+    }
+
+    // refits every cascade; returns the ones whose layer has to be redrawn,
+    // all of them when castersChanged (an alpha-tested caster's map did)
+    std::vector<unsigned> update(const Camera& camera, glm::vec3 lightDirection, glm::vec3 sceneLo, glm::vec3 sceneHi, std::vector<CascadeFit>& fits, bool castersChanged) {
+        auto light = glm::normalize(lightDirection);
+        if (light != toLight || castersChanged) {
+            toLight = light;
+            for (auto& cascade : cascades) cascade.valid = false;
+        }
+
+        auto splits = practicalSplits(camera.zNear, std::min(distance, camera.zFar), cascadeCount, splitLambda);
+        std::vector<unsigned> dirty;
+        fits.clear();
+        for (unsigned i = 0; i < cascadeCount; ++i) {
+            auto& cascade = cascades[i];
+            auto& fit = fits.emplace_back(fitCascade(camera, i == 0 ? camera.zNear : splits[i - 1], splits[i], toLight, sceneLo, sceneHi, resolution));
+            auto transform = fit.projection * fit.view;
+            cascade.splitFar = splits[i];
+            cascade.bias = 2.0f * fit.texelSize / fit.depthRange;
+            if (cascade.valid && cascade.transform == transform) continue;
+            cascade.transform = transform;
+            cascade.valid = true;
+            dirty.push_back(i);
+        }
+        return dirty;
+    }
+};
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "mapped_file.h"
+
+// How a texture is sampled by SCENE_FRAGMENT_SHADER, which decides its block format:
+//  - Color (map_Ka, map_Kd): gamma 2.2, BC1, or BC3 when the source has a real alpha channel
+//  - Linear (map_Ks, map_d): only .r is read, BC4
+//  - Normal (norm): only .xy are stored and z is rebuilt in the shader, BC5
+enum class TextureKind {
+    Color,
+    Linear,
+    Normal,
+};
+
+enum class BlockFormat : uint32_t {
+    BC1,
+    BC3,
+    BC4,
+    BC5,
+    RGBA8, // uncompressed, for drivers without S3TC
+};
+
+static size_t blockBytes(BlockFormat format) {
+    switch (format) {
+        case BlockFormat::BC1: return 8;
+        case BlockFormat::BC4: return 8;
+        case BlockFormat::BC3: return 16;
+        case BlockFormat::BC5: return 16;
+        case BlockFormat::RGBA8: return 64;
+    }
+    return 0;
+}
+
+// bytes of a whole level: 4x4 blocks, partial ones at the edges padded, or RGBA8 texels as they are
+static size_t levelBytes(BlockFormat format, int width, int height) {
+    if (format == BlockFormat::RGBA8) return 4 * size_t(width) * height;
+    return size_t((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+struct Image {
+    int width = 0, height = 0;
+    std::vector<uint8_t> pixels; // RGBA8
+
+    uint8_t* at(int x, int y) {
+        return &pixels[4 * (size_t(std::clamp(y, 0, height - 1)) * width + std::clamp(x, 0, width - 1))];
+    }
+
+    const uint8_t* at(int x, int y) const {
+        return const_cast<Image*>(this)->at(x, y);
+    }
+};
+
+struct TextureLevel {
+    int width, height;
+    std::vector<uint8_t> data;
+};
+
+struct CookedTexture {
+    BlockFormat format;
+    std::vector<TextureLevel> levels;
+};
+
+// ---- mip chain ----
+
+static float gammaToLinear(uint8_t c) {
+    static const auto table = [] {
+        std::array<float, 256> result;
+        for (int i = 0; i < 256; ++i) result[i] = std::pow(i / 255.0f, 2.2f);
+        return result;
+    }();
+    return table[c];
+}
+
+static uint8_t linearToGamma(float c) {
+    return uint8_t(std::lround(std::pow(std::clamp(c, 0.0f, 1.0f), 1.0f / 2.2f) * 255.0f));
+}
+
+// 2x2 box filter, averaging in the space the shader interprets the texels in
+static Image downsample(const Image& src, TextureKind kind) {
+    Image dst;
+    dst.width = std::max(1, src.width / 2);
+    dst.height = std::max(1, src.height / 2);
+    dst.pixels.resize(4 * size_t(dst.width) * dst.height);
+
+    for (int y = 0; y < dst.height; ++y) {
+        for (int x = 0; x < dst.width; ++x) {
+            const uint8_t* p[4] = {src.at(2 * x, 2 * y), src.at(2 * x + 1, 2 * y), src.at(2 * x, 2 * y + 1), src.at(2 * x + 1, 2 * y + 1)};
+            uint8_t* out = dst.at(x, y);
+
+            if (kind == TextureKind::Normal) {
+                glm::vec3 n{0.0f};
+                for (auto* q : p) n += glm::vec3{q[0], q[1], q[2]} / 127.5f - 1.0f;
+                n = glm::length(n) > 0.0f ? glm::normalize(n) : glm::vec3{0.0f, 0.0f, 1.0f};
+                for (int c = 0; c < 3; ++c) out[c] = uint8_t(std::lround((n[c] + 1.0f) * 127.5f));
+                out[3] = 255;
+                continue;
+            }
+
+            for (int c = 0; c < 4; ++c) {
+                if (kind == TextureKind::Color && c < 3) {
+                    float sum = 0.0f;
+                    for (auto* q : p) sum += gammaToLinear(q[c]);
+                    out[c] = linearToGamma(sum / 4.0f);
+                } else {
+                    out[c] = uint8_t((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+                }
+            }
+        }
+    }
+    return dst;
+}
+
+// ---- block codecs ----
+
+static uint16_t packRGB565(glm::vec3 c) {
+    auto r = unsigned(std::lround(std::clamp(c.r, 0.0f, 255.0f) * 31.0f / 255.0f));
+    auto g = unsigned(std::lround(std::clamp(c.g, 0.0f, 255.0f) * 63.0f / 255.0f));
+    auto b = unsigned(std::lround(std::clamp(c.b, 0.0f, 255.0f) * 31.0f / 255.0f));
+    return uint16_t(r << 11 | g << 5 | b);
+}
+
+static glm::vec3 unpackRGB565(uint16_t c) {
+    return {((c >> 11) & 31) * 255.0f / 31.0f, ((c >> 5) & 63) * 255.0f / 63.0f, (c & 31) * 255.0f / 31.0f};
+}
+
+// block is 16 RGBA texels, row-major; endpoints are fitted along the principal axis
+static void encodeBC1(const uint8_t* block, uint8_t* out) {
+    glm::vec3 texels[16], mean{0.0f};
+    for (int i = 0; i < 16; ++i) {
+        texels[i] = {block[4 * i], block[4 * i + 1], block[4 * i + 2]};
+        mean += texels[i] / 16.0f;
+    }
+
+    glm::mat3 cov{0.0f};
+    for (auto t : texels) cov += glm::outerProduct(t - mean, t - mean);
+    glm::vec3 axis{1.0f, 1.0f, 1.0f};
+    for (int i = 0; i < 8; ++i) {
+        auto next = cov * axis;
+        float len = glm::length(next);
+        if (len < 1e-6f) break;
+        axis = next / len;
+    }
+
+    float lo = 0.0f, hi = 0.0f;
+    for (auto t : texels) {
+        float d = glm::dot(t - mean, axis);
+        lo = std::min(lo, d);
+        hi = std::max(hi, d);
+    }
+
+    uint16_t c0 = packRGB565(mean + axis * hi), c1 = packRGB565(mean + axis * lo);
+    if (c0 < c1) std::swap(c0, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        glm::vec3 a = unpackRGB565(c0), b = unpackRGB565(c1);
+        glm::vec3 palette[4] = {a, b, (2.0f * a + b) / 3.0f, (a + 2.0f * b) / 3.0f};
+        for (int i = 0; i < 16; ++i) {
+            int best = 0;
+            float bestDist = INFINITY;
+            for (int k = 0; k < 4; ++k) {
+                auto d = texels[i] - palette[k];
+                float dist = glm::dot(d, d);
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    best = k;
+                }
+            }
+            indices |= uint32_t(best) << (2 * i);
+        }
+    }
+
+    std::memcpy(out, &c0, 2);
+    std::memcpy(out + 2, &c1, 2);
+    std::memcpy(out + 4, &indices, 4);
+}
+
+static void decodeBC1(const uint8_t* in, uint8_t* block) {
+    uint16_t c0, c1;
+    uint32_t indices;
+    std::memcpy(&c0, in, 2);
+    std::memcpy(&c1, in + 2, 2);
+    std::memcpy(&indices, in + 4, 4);
+
+    glm::vec3 a = unpackRGB565(c0), b = unpackRGB565(c1);
+    glm::vec4 palette[4] = {{a, 255.0f}, {b, 255.0f}};
+    if (c0 > c1) {
+        palette[2] = {(2.0f * a + b) / 3.0f, 255.0f};
+        palette[3] = {(a + 2.0f * b) / 3.0f, 255.0f};
+    } else {
+        palette[2] = {(a + b) / 2.0f, 255.0f};
+        palette[3] = {0.0f, 0.0f, 0.0f, 0.0f};
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        auto c = palette[(indices >> (2 * i)) & 3];
+        for (int k = 0; k < 4; ++k) block[4 * i + k] = uint8_t(std::lround(c[k]));
+    }
+}
+
+// single channel, read from block[channel] with a stride of 4
+static void encodeBC4(const uint8_t* block, int channel, uint8_t* out) {
+    uint8_t lo = 255, hi = 0;
+    for (int i = 0; i < 16; ++i) {
+        lo = std::min(lo, block[4 * i + channel]);
+        hi = std::max(hi, block[4 * i + channel]);
+    }
+
+    // r0 > r1 selects the 8-value mode: r0, r1 and six interpolants
+    int palette[8] = {hi, lo};
+    for (int k = 1; k <= 6; ++k) palette[k + 1] = ((7 - k) * hi + k * lo + 3) / 7;
+
+    uint64_t indices = 0;
+    if (hi != lo) {
+        for (int i = 0; i < 16; ++i) {
+            int value = block[4 * i + channel];
+            int best = 0;
+            for (int k = 1; k < 8; ++k) {
+                if (std::abs(palette[k] - value) < std::abs(palette[best] - value)) best = k;
+            }
+            indices |= uint64_t(best) << (3 * i);
+        }
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+    for (int i = 0; i < 6; ++i) out[2 + i] = uint8_t(indices >> (8 * i));
+}
+
+static void decodeBC4(const uint8_t* in, int channel, uint8_t* block) {
+    int r0 = in[0], r1 = in[1];
+    int palette[8] = {r0, r1};
+    if (r0 > r1) {
+        for (int k = 1; k <= 6; ++k) palette[k + 1] = ((7 - k) * r0 + k * r1 + 3) / 7;
+    } else {
+        for (int k = 1; k <= 4; ++k) palette[k + 1] = ((5 - k) * r0 + k * r1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; ++i) indices |= uint64_t(in[2 + i]) << (8 * i);
+    for (int i = 0; i < 16; ++i) block[4 * i + channel] = uint8_t(palette[(indices >> (3 * i)) & 7]);
+}
+
+static void encodeBlock(BlockFormat format, const uint8_t* block, uint8_t* out) {
+    switch (format) {
+        case BlockFormat::BC1: encodeBC1(block, out); break;
+        case BlockFormat::BC3: encodeBC4(block, 3, out); encodeBC1(block, out + 8); break;
+        case BlockFormat::BC4: encodeBC4(block, 0, out); break;
+        case BlockFormat::BC5: encodeBC4(block, 0, out); encodeBC4(block, 1, out + 8); break;
+        case BlockFormat::RGBA8: break;
+    }
+}
+
+static void decodeBlock(BlockFormat format, const uint8_t* in, uint8_t* block) {
+    static const uint8_t opaqueBlack[4] = {0, 0, 0, 255};
+    for (int i = 0; i < 16; ++i) std::memcpy(block + 4 * i, opaqueBlack, 4);
+    switch (format) {
+        case BlockFormat::BC1: decodeBC1(in, block); break;
+        case BlockFormat::BC3: decodeBC1(in + 8, block); decodeBC4(in, 3, block); break;
+        case BlockFormat::BC4: decodeBC4(in, 0, block); break;
+        case BlockFormat::BC5: decodeBC4(in, 0, block); decodeBC4(in + 8, 1, block); break;
+        case BlockFormat::RGBA8: break;
+    }
+}
+
+static TextureLevel encodeLevel(const Image& image, BlockFormat format) {
+    TextureLevel result{image.width, image.height, {}};
+    if (format == BlockFormat::RGBA8) {
+        result.data = image.pixels;
+        return result;
+    }
+
+    int bw = (image.width + 3) / 4, bh = (image.height + 3) / 4;
+    result.data.resize(levelBytes(format, image.width, image.height));
+    uint8_t block[64];
+    for (int by = 0; by < bh; ++by) {
+        for (int bx = 0; bx < bw; ++bx) {
+            // edge blocks repeat the last row/column
+            for (int i = 0; i < 16; ++i) std::memcpy(block + 4 * i, image.at(4 * bx + i % 4, 4 * by + i / 4), 4);
+            encodeBlock(format, block, &result.data[(size_t(by) * bw + bx) * blockBytes(format)]);
+        }
+    }
+    return result;
+}
+
+static Image decodeLevel(const TextureLevel& level, BlockFormat format) {
+    Image result{level.width, level.height, {}};
+    if (format == BlockFormat::RGBA8) {
+        result.pixels = level.data;
+        return result;
+    }
+
+    result.pixels.resize(4 * size_t(level.width) * level.height);
+    int bw = (level.width + 3) / 4, bh = (level.height + 3) / 4;
+    uint8_t block[64];
+    for (int by = 0; by < bh; ++by) {
+        for (int bx = 0; bx < bw; ++bx) {
+            decodeBlock(format, &level.data[(size_t(by) * bw + bx) * blockBytes(format)], block);
+            for (int i = 0; i < 16; ++i) {
+                int x = 4 * bx + i % 4, y = 4 * by + i / 4;
+                if (x < level.width && y < level.height) std::memcpy(result.at(x, y), block + 4 * i, 4);
+            }
+        }
+    }
+    return result;
+}
+
+// peak signal-to-noise ratio over the first `channels` channels, in dB
+static double psnr(const Image& a, const Image& b, int channels = 3) {
+    double sum = 0.0;
+    size_t count = 0;
+    for (size_t i = 0; i < a.pixels.size(); i += 4) {
+        for (int c = 0; c < channels; ++c) {
+            double d = double(a.pixels[i + c]) - double(b.pixels[i + c]);
+            sum += d * d;
+            ++count;
+        }
+    }
+    if (sum == 0.0) return INFINITY;
+    return 10.0 * std::log10(255.0 * 255.0 / (sum / count));
+}
+
+static BlockFormat chooseBlockFormat(const Image& image, TextureKind kind) {
+    switch (kind) {
+        case TextureKind::Linear: return BlockFormat::BC4;
+        case TextureKind::Normal: return BlockFormat::BC5;
+        case TextureKind::Color: break;
+    }
+    for (size_t i = 3; i < image.pixels.size(); i += 4) {
+        if (image.pixels[i] != 255) return BlockFormat::BC3;
+    }
+    return BlockFormat::BC1;
+}
+
+// full mip chain down to 1x1, every level filtered from the previous one
+static CookedTexture cookTexture(Image image, TextureKind kind) {
+    CookedTexture result;
+    result.format = chooseBlockFormat(image, kind);
+    for (;;) {
+        result.levels.push_back(encodeLevel(image, result.format));
+        if (image.width == 1 && image.height == 1) break;
+        image = downsample(image, kind);
+    }
+    return result;
+}
+
+// turns BC1/BC3 into RGBA8 for drivers without S3TC; BC4/BC5 are core
+static void decompressS3TC(CookedTexture& texture) {
+    if (texture.format != BlockFormat::BC1 && texture.format != BlockFormat::BC3) return;
+    for (auto& level : texture.levels) {
+        level.data = decodeLevel(level, texture.format).pixels;
+    }
+    texture.format = BlockFormat::RGBA8;
+}
+
+// ---- container ----
+//
+// layout: CookedTextureHeader, then per level u32 width, u32 height, u64 size, data padded to 8
+
+static const char COOKED_TEXTURE_MAGIC[8] = {'H', 'W', '2', 'T', 'E', 'X', 'T', 'R'};
+static const uint32_t COOKED_TEXTURE_VERSION = 1;
+static const uint32_t MAX_COOKED_LEVELS = 16; // 32768x32768 and down
+
+struct CookedTextureHeader {
+    char magic[8];
+    uint32_t version;
+    BlockFormat format;
+    uint32_t levelCount;
+    uint32_t kind;
+    SourceStamp source;
+};
+
+static std::optional<CookedTexture> loadCookedTexture(const std::string& path, SourceStamp source, TextureKind kind) {
+    if (!std::filesystem::exists(path)) return std::nullopt;
+
+    MappedFile file{path};
+    auto data = file.view();
+    size_t pos = 0;
+    auto read = [&](void* out, size_t size) {
+        if (data.size() - pos < size) return false;
+        std::memcpy(out, data.data() + pos, size);
+        pos += size;
+        return true;
+    };
+
+    CookedTextureHeader header;
+    if (!read(&header, sizeof(header))) return std::nullopt;
+    if (std::memcmp(header.magic, COOKED_TEXTURE_MAGIC, sizeof(header.magic)) != 0) return std::nullopt;
+    if (header.version != COOKED_TEXTURE_VERSION || header.kind != uint32_t(kind) || header.source != source) return std::nullopt;
+    if (header.format > BlockFormat::RGBA8 || header.levelCount == 0 || header.levelCount > MAX_COOKED_LEVELS) return std::nullopt;
+
+    // anything the uploads would trust is checked, so a corrupt file is cooked again rather than uploaded
+    CookedTexture result;
+    result.format = header.format;
+    for (uint32_t i = 0; i < header.levelCount; ++i) {
+        uint32_t width, height;
+        uint64_t size;
+        if (!read(&width, 4) || !read(&height, 4) || !read(&size, 8)) return std::nullopt;
+        if (i == 0 && (width == 0 || height == 0 || width >= 1u << (MAX_COOKED_LEVELS - 1) || height >= 1u << (MAX_COOKED_LEVELS - 1))) return std::nullopt;
+        if (i > 0 && (int(width) != std::max(1, result.levels.back().width / 2) || int(height) != std::max(1, result.levels.back().height / 2))) return std::nullopt;
+        if (size != levelBytes(header.format, width, height) || size > data.size() - pos) return std::nullopt;
+        auto& level = result.levels.emplace_back(TextureLevel{int(width), int(height), {}});
+        level.data.resize(size);
+        read(level.data.data(), size);
+        pos = std::min(data.size(), (pos + 7) & ~size_t{7});
+    }
+    if (result.levels.back().width != 1 || result.levels.back().height != 1) return std::nullopt; // cookTexture goes down to 1x1
+    return result;
+}
+
+// failures are not fatal: the texture is simply cooked again next time
+static bool writeCookedTexture(const std::string& path, const CookedTexture& texture, SourceStamp source, TextureKind kind) {
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream out{tmp, std::ios::binary | std::ios::trunc};
+        if (!out) return false;
+
+        CookedTextureHeader header{};
+        std::memcpy(header.magic, COOKED_TEXTURE_MAGIC, sizeof(header.magic));
+        header.version = COOKED_TEXTURE_VERSION;
+        header.format = texture.format;
+        header.levelCount = texture.levels.size();
+        header.kind = uint32_t(kind);
+        header.source = source;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        static const char zeros[8] = {};
+        for (const auto& level : texture.levels) {
+            uint32_t width = level.width, height = level.height;
+            uint64_t size = level.data.size();
+            out.write(reinterpret_cast<const char*>(&width), 4);
+            out.write(reinterpret_cast<const char*>(&height), 4);
+            out.write(reinterpret_cast<const char*>(&size), 8);
+            out.write(reinterpret_cast<const char*>(level.data.data()), size);
+            out.write(zeros, (8 - size % 8) % 8);
+        }
+
+        if (!out) return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
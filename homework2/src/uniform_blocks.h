@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Host mirrors of the std140 blocks in the scene shaders. The array
+// sizes are passed to the shader with withDefines, so they only live here.
+
+static const unsigned MAX_LIGHTS = 16384; // four texels each, the smallest GL_MAX_TEXTURE_BUFFER_SIZE allowed
+static const unsigned MAX_SHADOWED_LIGHTS = 16;
+static const unsigned MAX_MATERIALS = 256; // fits in 16 KiB, the smallest GL_MAX_UNIFORM_BLOCK_SIZE allowed
+static const unsigned MAX_CASCADES = 4;
+static const unsigned MAX_TEXTURE_ARRAYS = 11; // material units, the 5 after them of the 16 GL 3.3 guarantees are for lighting
+
+static const GLuint LIGHTS_BINDING = 0;
+static const GLuint MATERIALS_BINDING = 1;
+static const GLuint FRAME_BINDING = 2;
+static const GLuint SHADOW_ATLAS_BINDING = 3;
+
+// one light in the RGBA32F lights texture buffer, four texels; not a uniform block
+struct LightBlock {
+    glm::vec3 position;
+    float directional; // 0 or 1
+    glm::vec3 diffuse;
+    float shadowSlot; // in ShadowAtlasBlock, -1 for none
+    glm::vec3 specular;
+    float pad0;
+    glm::vec3 attenuation;
+    float pad1;
+};
+
+// how a fragment finds its cluster, see ClusterGrid
+struct LightsBlock {
+    glm::vec2 viewportSize;
+    float clusterNear;
+    float clusterScale; // slices per unit of log depth
+};
+
+// which maps a material samples is baked into its shader permutation, where
+// they are is in maps, see TextureManager::location
+struct MaterialBlock {
+    glm::vec4 Ka;
+    glm::vec4 Kd;
+    glm::vec4 Ks;    // w: Ns
+    glm::uvec4 maps; // Ka | Kd << 16, d | norm << 16, Ks, and 4 bits of TextureManager::minLod each in w
+};
+
+// everything a pass shares between programs
+struct FrameBlock {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 shadowTransforms[MAX_CASCADES];
+    glm::vec4 cascadeSplits; // view depth where each cascade ends
+    glm::vec4 cascadeBias;
+    GLint cascadeCount;
+    GLint pad[3];
+    glm::vec4 cameraPosition;
+    glm::vec4 positionOffset;
+    glm::vec4 positionScale;
+};
+
+// point light shadows, six cube faces per light
+struct ShadowAtlasBlock {
+    glm::mat4 faceTransforms[MAX_SHADOWED_LIGHTS * 6]; // world to atlas texture coordinates and depth
+    glm::vec4 faceRects[MAX_SHADOWED_LIGHTS * 6];      // min xy, max xy of the tile
+    glm::vec4 lights[MAX_SHADOWED_LIGHTS];             // x: shadowed, y: receiver offset toward the light per unit of distance
+};
+
+static_assert(sizeof(LightBlock) == 64 && offsetof(LightBlock, directional) == 12 && offsetof(LightBlock, attenuation) == 48);
+static_assert(sizeof(LightsBlock) == 16);
+static_assert(sizeof(MaterialBlock) == 64 && sizeof(MaterialBlock) * MAX_MATERIALS <= 16384);
+static_assert(MAX_CASCADES == 4, "cascadeSplits and cascadeBias are a vec4");
+static_assert(MAX_TEXTURE_ARRAYS == 11, "sample_map in MATERIAL_SHADER has a branch per array");
+static_assert(offsetof(FrameBlock, cascadeSplits) == 384 && offsetof(FrameBlock, cameraPosition) == 432 && sizeof(FrameBlock) == 480);
+static_assert(sizeof(ShadowAtlasBlock) <= 16384);
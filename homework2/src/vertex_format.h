@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+#include "scene.h"
+
+// Compact vertex layout, 20 bytes instead of the 56 of VertexData:
+//  - position: unorm16 inside the bounds it is packed with (the whole scene's in
+//    DrawableScene), error ~ extent / 131070 per axis
+//  - texcoord: half floats, relative error <= 2^-11
+//  - tangent frame: QTangent, a unit quaternion as snorm16 whose w sign is the
+//    bitangent handedness; the decoded frame is within 1e-3 rad of the source
+struct PackedVertexData {
+    uint16_t position[4]; // w is padding
+    uint16_t texcoord[2];
+    int16_t qtangent[4];  // x, y, z, w
+};
+
+struct PackedBounds {
+    glm::vec3 offset{0.0f};
+    glm::vec3 scale{1.0f};
+};
+
+static PackedBounds packedBounds(std::span<const VertexData> vertices) {
+    if (vertices.empty()) return {};
+    glm::vec3 lo = vertices[0].position, hi = lo;
+    for (const auto& vertex : vertices) {
+        lo = glm::min(lo, vertex.position);
+        hi = glm::max(hi, vertex.position);
+    }
+    return {lo, hi - lo};
+}
+
+// rotation taking (x, y, z) to (tangent, bitangent, normal), with the handedness stored in the sign of w
+static glm::vec4 encodeQTangent(glm::vec3 normal, glm::vec3 tangent, glm::vec3 bitangent) {
+    static const float bias = 1.0f / 32767.0f;
+
+    if (glm::dot(normal, normal) == 0.0f) return {0.0f, 0.0f, 0.0f, 1.0f};
+    auto n = glm::normalize(normal);
+    auto t = tangent - n * glm::dot(n, tangent);
+    t = glm::dot(t, t) > 0.0f ? glm::normalize(t) : anyPerpendicular(n);
+    auto b = glm::cross(n, t);
+    bool reflected = glm::dot(b, bitangent) < 0.0f;
+
+    auto q = glm::normalize(glm::quat_cast(glm::mat3{t, b, n}));
+    glm::vec4 result{q.x, q.y, q.z, q.w};
+    if (result.w < 0.0f) result = -result;
+
+    // keep w away from zero so that its sign survives quantization
+    if (result.w < bias) {
+        float k = glm::sqrt(1.0f - bias * bias) / glm::length(glm::vec3{result});
+        result = {glm::vec3{result} * k, bias};
+    }
+
+    return reflected ? -result : result;
+}
+
+static void decodeQTangent(glm::vec4 q, glm::vec3& normal, glm::vec3& tangent, glm::vec3& bitangent) {
+    auto rotate = [q = glm::normalize(q)](glm::vec3 v) {
+        glm::vec3 u{q};
+        return v + 2.0f * glm::cross(u, glm::cross(u, v) + q.w * v);
+    };
+    tangent = rotate({1.0f, 0.0f, 0.0f});
+    bitangent = rotate({0.0f, 1.0f, 0.0f}) * (q.w < 0.0f ? -1.0f : 1.0f);
+    normal = rotate({0.0f, 0.0f, 1.0f});
+}
+
+static PackedVertexData packVertex(const VertexData& vertex, const PackedBounds& bounds) {
+    PackedVertexData result{};
+    for (int i = 0; i < 3; ++i) {
+        float rel = bounds.scale[i] > 0.0f ? (vertex.position[i] - bounds.offset[i]) / bounds.scale[i] : 0.0f;
+        result.position[i] = glm::packUnorm1x16(rel);
+    }
+    result.texcoord[0] = glm::packHalf1x16(vertex.texcoord.x);
+    result.texcoord[1] = glm::packHalf1x16(vertex.texcoord.y);
+    auto q = encodeQTangent(vertex.normal, vertex.tangent, vertex.bitangent);
+    for (int i = 0; i < 4; ++i) {
+        result.qtangent[i] = static_cast<int16_t>(glm::packSnorm1x16(q[i]));
+    }
+    return result;
+}
+
+// CPU mirror of the PACKED_VERTICES path of SCENE_VERTEX_SHADER
+static VertexData unpackVertex(const PackedVertexData& packed, const PackedBounds& bounds) {
+    VertexData result{};
+    for (int i = 0; i < 3; ++i) {
+        result.position[i] = bounds.offset[i] + glm::unpackUnorm1x16(packed.position[i]) * bounds.scale[i];
+    }
+    result.texcoord = {glm::unpackHalf1x16(packed.texcoord[0]), glm::unpackHalf1x16(packed.texcoord[1])};
+    glm::vec4 q;
+    for (int i = 0; i < 4; ++i) {
+        q[i] = glm::unpackSnorm1x16(static_cast<uint16_t>(packed.qtangent[i]));
+    }
+    decodeQTangent(q, result.normal, result.tangent, result.bitangent);
+    return result;
+}
+
+static std::vector<PackedVertexData> packVertices(std::span<const VertexData> vertices, const PackedBounds& bounds) {
+    std::vector<PackedVertexData> result(vertices.size());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        result[i] = packVertex(vertices[i], bounds);
+    }
+    return result;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+// The tests are plain executables run by ctest: a failed check prints where
+// it is and exits with 1.
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n";    \
+            std::exit(1);                                                                      \
+        }                                                                                      \
+    } while (false)
+
+// whether body() throws std::runtime_error, the way the renderer reports failures
+static bool throws(auto body) {
+    try {
+        body();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
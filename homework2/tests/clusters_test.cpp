@@ -0,0 +1,86 @@
+#include <random>
+#include "clusters.h"
+#include "check.h"
+
+// a light is listed in every cluster a point of its sphere falls in, and in none its bounding box misses
+int main() {
+    std::mt19937 random{1};
+    std::uniform_real_distribution<float> uniform{0.0f, 1.0f};
+
+    // identity view: the camera looks down -z, so view space is world space
+    float fov = glm::radians(60.0f), aspectRatio = 16.0f / 9.0f;
+    std::vector<LightSphere> lights;
+    for (int i = 0; i < 40; ++i) {
+        float depth = 20000.0f * std::pow(uniform(random), 2.0f) - 50.0f;
+        glm::vec3 center{(uniform(random) * 2.0f - 1.0f) * depth, (uniform(random) * 2.0f - 1.0f) * depth * 0.6f, -depth};
+        lights.push_back({center, 5.0f + 500.0f * std::pow(uniform(random), 3.0f)});
+    }
+    lights.push_back({{0.0f, 0.0f, 0.0f}, 20.0f});             // around the eye, reaching past near
+    lights.push_back({{0.0f, 0.0f, 500.0f}, 100.0f});          // behind the eye
+    lights.push_back({{0.0f, 0.0f, -100.0f}, INFINITY});       // everywhere
+
+    ThreadPool pool{3};
+    ClusterGrid grid;
+    grid.assign(glm::mat4{1.0f}, fov, aspectRatio, lights, pool);
+    CHECK(grid.ranges.size() == 2 * CLUSTER_COUNT);
+
+    auto listed = [&](unsigned cluster, uint32_t light) {
+        auto begin = grid.indices.begin() + grid.ranges[2 * cluster];
+        auto end = begin + grid.ranges[2 * cluster + 1];
+        CHECK(std::is_sorted(begin, end));
+        return std::binary_search(begin, end, light);
+    };
+
+    // the cluster of a view space point, false outside the frustum
+    auto clusterOf = [&](glm::vec3 p, unsigned& cluster) {
+        float depth = -p.z;
+        if (depth <= 0.0f || depth >= grid.far) return false;
+        float ndcX = p.x / (depth * grid.tanX), ndcY = p.y / (depth * grid.tanY);
+        if (std::abs(ndcX) >= 1.0f || std::abs(ndcY) >= 1.0f) return false;
+        unsigned x = std::min<unsigned>((ndcX * 0.5f + 0.5f) * CLUSTERS_X, CLUSTERS_X - 1);
+        unsigned y = std::min<unsigned>((ndcY * 0.5f + 0.5f) * CLUSTERS_Y, CLUSTERS_Y - 1);
+        cluster = ClusterGrid::index(x, y, grid.slice(depth));
+        return true;
+    };
+
+    for (uint32_t light = 0; light < lights.size(); ++light) {
+        const auto& sphere = lights[light];
+        if (std::isinf(sphere.radius)) {
+            for (unsigned cluster = 0; cluster < CLUSTER_COUNT; ++cluster) CHECK(listed(cluster, light));
+            continue;
+        }
+
+        // no misses: random points inside the sphere
+        for (int i = 0; i < 20000; ++i) {
+            glm::vec3 offset;
+            do offset = glm::vec3{uniform(random), uniform(random), uniform(random)} * 2.0f - 1.0f; while (glm::length(offset) > 1.0f);
+            unsigned cluster;
+            if (clusterOf(sphere.center + offset * sphere.radius, cluster)) CHECK(listed(cluster, light));
+        }
+
+        // nothing extra: a listed froxel comes within a sample spacing of the sphere's bounding box
+        const int SAMPLES = 8;
+        for (unsigned z = 0; z < CLUSTERS_Z; ++z) {
+            float sliceNear = std::max(grid.sliceStart(z), 1e-3f), sliceFar = z + 1 == CLUSTERS_Z ? grid.far : grid.sliceStart(z + 1);
+            for (unsigned y = 0; y < CLUSTERS_Y; ++y) {
+                for (unsigned x = 0; x < CLUSTERS_X; ++x) {
+                    if (!listed(ClusterGrid::index(x, y, z), light)) continue;
+                    auto corner = [&](float u, float v, float w) {
+                        float depth = sliceNear + (sliceFar - sliceNear) * w;
+                        float ndcX = (x + u) / CLUSTERS_X * 2.0f - 1.0f, ndcY = (y + v) / CLUSTERS_Y * 2.0f - 1.0f;
+                        return glm::vec3{ndcX * depth * grid.tanX, ndcY * depth * grid.tanY, -depth};
+                    };
+                    float spacing = glm::length(corner(1.0f, 1.0f, 1.0f) - corner(0.0f, 0.0f, 0.0f)) / (SAMPLES - 1);
+                    float closest = INFINITY;
+                    for (int i = 0; i < SAMPLES * SAMPLES * SAMPLES; ++i) {
+                        auto p = corner(float(i % SAMPLES) / (SAMPLES - 1), float(i / SAMPLES % SAMPLES) / (SAMPLES - 1), float(i / SAMPLES / SAMPLES) / (SAMPLES - 1));
+                        auto outside = glm::max(glm::abs(p - sphere.center) - sphere.radius, 0.0f);
+                        closest = std::min(closest, glm::length(outside));
+                    }
+                    CHECK(closest <= spacing);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <algorithm>
+#include <vector>
+#include "render_state.h"
+#include "check.h"
+
+// the main pass draws in ascending key order
+int main() {
+    // blended draws go back to front whatever their program and textures
+    auto nearBlended = DrawKey::make(DrawPass::Main, BlendMode::Alpha, 0, 0, 100.0f);
+    auto farBlended = DrawKey::make(DrawPass::Main, BlendMode::Alpha, 7, 3, 900.0f);
+    std::vector<uint64_t> keys{nearBlended, farBlended};
+    std::sort(keys.begin(), keys.end());
+    CHECK(keys[0] == farBlended && keys[1] == nearBlended);
+    CHECK(DrawKey::make(DrawPass::Main, BlendMode::Alpha, 255, 0x1fffffff, 900.0f) < DrawKey::make(DrawPass::Main, BlendMode::Alpha, 0, 0, 899.0f));
+
+    // opaque draws are grouped by program, then textures, then go front to back
+    auto nearOpaque = DrawKey::make(DrawPass::Main, BlendMode::Opaque, 1, 0, 100.0f);
+    auto farOpaque = DrawKey::make(DrawPass::Main, BlendMode::Opaque, 0, 5, 900.0f);
+    CHECK(farOpaque < nearOpaque);
+    CHECK(DrawKey::make(DrawPass::Main, BlendMode::Opaque, 1, 0, 900.0f) < DrawKey::make(DrawPass::Main, BlendMode::Opaque, 1, 1, 100.0f));
+    CHECK(nearOpaque < DrawKey::make(DrawPass::Main, BlendMode::Opaque, 1, 0, 900.0f));
+
+    // everything opaque before everything blended, shadows first
+    CHECK(DrawKey::make(DrawPass::Main, BlendMode::Opaque, 255, 0x1fffffff, 1e9f) < DrawKey::make(DrawPass::Main, BlendMode::Alpha, 0, 0, 1e9f));
+    CHECK(DrawKey::make(DrawPass::Shadow, BlendMode::Alpha, 255, 0, 0.0f) < DrawKey::make(DrawPass::Main, BlendMode::Opaque, 0, 0, 0.0f));
+    return 0;
+}
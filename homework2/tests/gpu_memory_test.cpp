@@ -0,0 +1,28 @@
+#include "gl_objects.h"
+#include "check.h"
+
+// GpuMemory is bookkeeping only, so the resources are registered by hand; no context
+int main() {
+    const size_t MIB = 1024 * 1024;
+    auto& memory = GpuMemory::instance();
+    memory.label(GL_BUFFER, 1, GpuCategory::Geometry, "vertices");
+    memory.resize(GL_BUFFER, 1, 3 * MIB);
+    memory.label(GL_TEXTURE, 1, GpuCategory::Shadows, "shadow atlas");
+    memory.resize(GL_TEXTURE, 1, 2 * MIB);
+    CHECK(memory.total() == 5 * MIB);
+    CHECK(memory.total(GpuCategory::Geometry) == 3 * MIB);
+
+    CHECK(!throws([&] { memory.expectWithin(5 * MIB); }));
+    CHECK(throws([&] { memory.expectWithin(4 * MIB); }));
+    CHECK(!throws([&] { memory.expectWithin(GpuCategory::Shadows, 2 * MIB); }));
+    CHECK(throws([&] { memory.expectWithin(GpuCategory::Geometry, 2 * MIB); }));
+
+    // growing past the budget fails, freeing gets back under it
+    memory.resize(GL_BUFFER, 2, 1);
+    CHECK(throws([&] { memory.expectWithin(5 * MIB); }));
+    memory.forget(GL_BUFFER, 2);
+    memory.forget(GL_BUFFER, 1);
+    CHECK(memory.total() == 2 * MIB);
+    CHECK(!throws([&] { memory.expectWithin(4 * MIB); }));
+    return 0;
+}
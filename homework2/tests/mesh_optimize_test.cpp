@@ -0,0 +1,19 @@
+#include "mesh_optimize.h"
+#include "meshes.h"
+#include "check.h"
+
+// Tipsify reorders the triangles without changing them and never makes the cache worse
+int main() {
+    auto mesh = testMesh();
+    auto optimized = optimizeVertexCache(mesh.indices, mesh.vertices.size());
+    CHECK(sortedTriangles(optimized) == sortedTriangles(mesh.indices));
+
+    auto before = simulateVertexCache(mesh.indices, mesh.vertices.size());
+    auto after = simulateVertexCache(optimized, mesh.vertices.size());
+    std::cout << "ACMR " << before.acmr() << " -> " << after.acmr() << "\n";
+    CHECK(after.acmr() <= before.acmr());
+
+    // and an already optimized order stays as good
+    CHECK(simulateVertexCache(optimizeVertexCache(optimized, mesh.vertices.size()), mesh.vertices.size()).acmr() <= after.acmr());
+    return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <glm/ext.hpp>
+#include "scene.h"
+
+// a bumpy 64x64 grid and a UV sphere above it, as one mesh with its triangles shuffled
+static SceneObject testMesh() {
+    SceneObject result;
+    auto& vertices = result.vertices;
+    std::vector<std::array<unsigned, 3>> triangles;
+    auto quad = [&](unsigned a, unsigned b, unsigned c, unsigned d) {
+        triangles.push_back({a, b, c});
+        triangles.push_back({a, c, d});
+    };
+
+    const unsigned GRID = 64;
+    for (unsigned y = 0; y <= GRID; ++y) {
+        for (unsigned x = 0; x <= GRID; ++x) {
+            float height = 4.0f * std::sin(0.3f * x) * std::cos(0.2f * y);
+            vertices.push_back({{float(x) * 10.0f, height, float(y) * 10.0f}, {}, {}, {}, {}});
+        }
+    }
+    for (unsigned y = 0; y < GRID; ++y) {
+        for (unsigned x = 0; x < GRID; ++x) {
+            unsigned i = y * (GRID + 1) + x;
+            quad(i, i + GRID + 1, i + GRID + 2, i + 1);
+        }
+    }
+
+    const unsigned RINGS = 24, SEGMENTS = 48;
+    unsigned base = vertices.size();
+    for (unsigned ring = 0; ring <= RINGS; ++ring) {
+        float theta = glm::pi<float>() * ring / RINGS;
+        for (unsigned segment = 0; segment <= SEGMENTS; ++segment) {
+            float phi = glm::two_pi<float>() * segment / SEGMENTS;
+            glm::vec3 direction{std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+            vertices.push_back({glm::vec3{320.0f, 200.0f, 320.0f} + 100.0f * direction, {}, {}, {}, {}});
+        }
+    }
+    for (unsigned ring = 0; ring < RINGS; ++ring) {
+        for (unsigned segment = 0; segment < SEGMENTS; ++segment) {
+            unsigned i = base + ring * (SEGMENTS + 1) + segment;
+            quad(i, i + 1, i + SEGMENTS + 2, i + SEGMENTS + 1);
+        }
+    }
+
+    std::shuffle(triangles.begin(), triangles.end(), std::mt19937{1});
+    for (const auto& triangle : triangles) result.indices.insert(result.indices.end(), triangle.begin(), triangle.end());
+    return result;
+}
+
+// the triangles of indices, each rotated to start at its smallest index, sorted; equal for permutations of the same triangles
+static std::vector<std::array<unsigned, 3>> sortedTriangles(const std::vector<unsigned>& indices) {
+    std::vector<std::array<unsigned, 3>> result;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        std::array<unsigned, 3> triangle{indices[i], indices[i + 1], indices[i + 2]};
+        std::rotate(triangle.begin(), std::min_element(triangle.begin(), triangle.end()), triangle.end());
+        result.push_back(triangle);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
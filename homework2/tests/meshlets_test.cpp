@@ -0,0 +1,31 @@
+#include "meshlets.h"
+#include "meshes.h"
+#include "check.h"
+
+// every triangle lands in exactly one meshlet, and each meshlet's bounds hold its triangles
+int main() {
+    auto mesh = testMesh();
+    auto indices = mesh.indices;
+    auto meshlets = buildMeshlets(mesh.vertices, indices);
+    CHECK(sortedTriangles(indices) == sortedTriangles(mesh.indices));
+
+    // the ranges tile the rewritten indices, so no triangle is in two meshlets or none
+    size_t covered = 0;
+    for (const auto& meshlet : meshlets) {
+        CHECK(meshlet.indexOffset == covered);
+        CHECK(meshlet.indexCount > 0 && meshlet.indexCount % 3 == 0);
+        CHECK(meshlet.indexCount <= 3 * MESHLET_MAX_TRIANGLES);
+        covered += meshlet.indexCount;
+
+        for (unsigned i = meshlet.indexOffset; i < meshlet.indexOffset + meshlet.indexCount; i += 3) {
+            auto n = triangleNormal(mesh.vertices, &indices[i]);
+            CHECK(n == glm::vec3{0.0f} || glm::dot(meshlet.cone.axis, n) >= meshlet.cone.cosAngle - 1e-5f);
+            for (int k = 0; k < 3; ++k) {
+                CHECK(glm::length(mesh.vertices[indices[i + k]].position - meshlet.center) <= meshlet.radius * (1.0f + 1e-5f));
+            }
+        }
+    }
+    CHECK(covered == indices.size());
+    std::cout << meshlets.size() << " meshlets for " << indices.size() / 3 << " triangles\n";
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <glm/ext.hpp>
+#include "occlusion.h"
+#include "check.h"
+
+// boxes behind a full-screen occluder are occluded, boxes in front of it, through it or beside it are not
+int main() {
+    auto projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 1.0f, 10000.0f);
+    auto view = glm::lookAt(glm::vec3{0.0f}, glm::vec3{0.0f, 0.0f, -1.0f}, glm::vec3{0.0f, 1.0f, 0.0f});
+
+    // a wall at z = -100 reaching well past the frustum, counter-clockwise towards the eye
+    const float L = 1000.0f;
+    std::vector<OccluderTriangle> wall{
+        {{-L, -L, -100.0f}, {L, -L, -100.0f}, {L, L, -100.0f}},
+        {{-L, -L, -100.0f}, {L, L, -100.0f}, {-L, L, -100.0f}},
+    };
+
+    ThreadPool pool{3};
+    OcclusionBuffer buffer;
+    buffer.render(projection * view, wall, pool);
+
+    CHECK(buffer.occludedBox({-5.0f, -5.0f, -250.0f}, {5.0f, 5.0f, -200.0f}));
+    CHECK(buffer.occludedBox({-60.0f, -30.0f, -400.0f}, {40.0f, 30.0f, -300.0f}));     // several pixels wide, tested on the pyramid
+    CHECK(buffer.occludedBox({-2000.0f, -1000.0f, -3000.0f}, {2000.0f, 1000.0f, -2000.0f})); // past the screen edges
+    CHECK(buffer.occludedSphere({10.0f, 20.0f, -500.0f}, 30.0f));
+
+    CHECK(!buffer.occludedBox({-5.0f, -5.0f, -60.0f}, {5.0f, 5.0f, -50.0f}));  // in front
+    CHECK(!buffer.occludedBox({-5.0f, -5.0f, -150.0f}, {5.0f, 5.0f, -90.0f})); // through the wall
+    CHECK(!buffer.occludedBox({-5.0f, -5.0f, 5.0f}, {5.0f, 5.0f, 10.0f}));     // behind the eye
+    CHECK(!buffer.occludedSphere({0.0f, 0.0f, 0.0f}, 5.0f));                  // around the eye
+
+    // a wall that leaves the left half of the screen open hides nothing there
+    std::vector<OccluderTriangle> half{
+        {{0.0f, -L, -100.0f}, {L, -L, -100.0f}, {L, L, -100.0f}},
+        {{0.0f, -L, -100.0f}, {L, L, -100.0f}, {0.0f, L, -100.0f}},
+    };
+    buffer.render(projection * view, half, pool);
+    CHECK(buffer.occludedBox({20.0f, -5.0f, -250.0f}, {30.0f, 5.0f, -200.0f}));
+    CHECK(!buffer.occludedBox({-30.0f, -5.0f, -250.0f}, {-20.0f, 5.0f, -200.0f}));
+    CHECK(!buffer.occludedBox({-10.0f, -5.0f, -250.0f}, {10.0f, 5.0f, -200.0f})); // straddling the edge
+
+    // the back of the wall hides nothing
+    std::vector<OccluderTriangle> back{
+        {{-L, -L, -100.0f}, {L, L, -100.0f}, {L, -L, -100.0f}},
+        {{-L, -L, -100.0f}, {-L, L, -100.0f}, {L, L, -100.0f}},
+    };
+    buffer.render(projection * view, back, pool);
+    CHECK(!buffer.occludedBox({-5.0f, -5.0f, -250.0f}, {5.0f, 5.0f, -200.0f}));
+
+    // the bands are independent, so the thread count does not change the buffer
+    ThreadPool single{0};
+    OcclusionBuffer alone;
+    buffer.render(projection * view, wall, pool);
+    alone.render(projection * view, wall, single);
+    CHECK(alone.depth == buffer.depth && alone.pyramid == buffer.pyramid);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include "texture_cooker.h"
+#include "check.h"
+
+// smooth gradients with a sharp disc and a little noise, alpha falling off from the centre
+static Image testImage(int size) {
+    Image image{size, size, std::vector<uint8_t>(4 * size_t(size) * size)};
+    std::mt19937 random{1};
+    std::uniform_int_distribution<int> noise{-6, 6};
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            float u = float(x) / size, v = float(y) / size;
+            float r = glm::length(glm::vec2{u, v} - 0.5f);
+            glm::vec4 c{u, v, 0.5f + 0.5f * std::sin(20.0f * u * v), glm::clamp(1.5f - 3.0f * r, 0.0f, 1.0f)};
+            if (r < 0.2f) c = {1.0f - c.x, 0.2f, 0.9f, c.w};
+            auto* texel = image.at(x, y);
+            for (int i = 0; i < 4; ++i) texel[i] = uint8_t(std::clamp(int(c[i] * 255.0f) + (i < 3 ? noise(random) : 0), 0, 255));
+        }
+    }
+    return image;
+}
+
+// every block format round-trips the image above a PSNR floor; prints the encode throughput
+static void checkCodecs() {
+    auto image = testImage(512);
+    struct Case {
+        BlockFormat format;
+        const char* name;
+        int channels; // the ones the format keeps, in psnr's order
+        double floor; // dB
+    };
+    for (auto [format, name, channels, floor] : {Case{BlockFormat::BC1, "BC1", 3, 35.0}, Case{BlockFormat::BC3, "BC3", 4, 36.0},
+                                                 Case{BlockFormat::BC4, "BC4", 1, 46.0}, Case{BlockFormat::BC5, "BC5", 2, 46.0}}) {
+        auto start = std::chrono::steady_clock::now();
+        auto level = encodeLevel(image, format);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        CHECK(level.data.size() == size_t(image.width / 4) * (image.height / 4) * blockBytes(format));
+        double quality = psnr(image, decodeLevel(level, format), channels);
+        std::cout << name << ": " << quality << " dB, " << image.pixels.size() / elapsed.count() / (1024 * 1024) << " MB/s\n";
+        CHECK(quality >= floor);
+    }
+}
+
+static void checkBlockFormats() {
+    auto image = testImage(8);
+    for (size_t i = 3; i < image.pixels.size(); i += 4) image.pixels[i] = 255;
+    CHECK(chooseBlockFormat(image, TextureKind::Color) == BlockFormat::BC1);
+    image.pixels[4 * 13 + 3] = 254; // one texel short of opaque
+    CHECK(chooseBlockFormat(image, TextureKind::Color) == BlockFormat::BC3);
+    CHECK(chooseBlockFormat(image, TextureKind::Linear) == BlockFormat::BC4);
+    CHECK(chooseBlockFormat(image, TextureKind::Normal) == BlockFormat::BC5);
+}
+
+// a black and white checker averages to half the light, not half the gamma encoded value
+static void checkDownsample() {
+    Image checker{2, 2, {0, 0, 0, 0, 255, 255, 255, 255, 255, 255, 255, 255, 0, 0, 0, 0}};
+    auto color = downsample(checker, TextureKind::Color);
+    CHECK(color.width == 1 && color.height == 1);
+    for (int c = 0; c < 3; ++c) CHECK(color.pixels[c] == 186);
+    CHECK(color.pixels[3] == 128); // alpha stays linear
+    auto linear = downsample(checker, TextureKind::Linear);
+    for (int c = 0; c < 4; ++c) CHECK(linear.pixels[c] == 128);
+}
+
+// non-square, non power of two: every level halves, rounding down, to 1x1
+static void checkMipChain() {
+    auto texture = cookTexture(testImage(37), TextureKind::Color);
+    CHECK(texture.levels.size() == 6);
+    int width = 37, height = 37;
+    for (const auto& level : texture.levels) {
+        CHECK(level.width == width && level.height == height);
+        CHECK(level.data.size() == levelBytes(texture.format, width, height));
+        width = std::max(1, width / 2), height = std::max(1, height / 2);
+    }
+
+    Image wide = testImage(64);
+    wide.height = 5;
+    wide.pixels.resize(4 * size_t(wide.width) * wide.height);
+    auto strip = cookTexture(wide, TextureKind::Linear);
+    CHECK(strip.levels.size() == 7);
+    CHECK(strip.levels[2].width == 16 && strip.levels[2].height == 1);
+    CHECK(strip.levels.back().width == 1 && strip.levels.back().height == 1);
+}
+
+static void checkDecompressS3TC() {
+    auto image = testImage(20);
+    for (auto kind : {TextureKind::Color, TextureKind::Linear}) {
+        auto texture = cookTexture(image, kind);
+        auto original = texture;
+        decompressS3TC(texture);
+        if (original.format == BlockFormat::BC4) {
+            CHECK(texture.format == BlockFormat::BC4 && texture.levels[0].data == original.levels[0].data); // core, left alone
+            continue;
+        }
+        CHECK(texture.format == BlockFormat::RGBA8);
+        for (size_t i = 0; i < texture.levels.size(); ++i) {
+            CHECK(texture.levels[i].data.size() == levelBytes(BlockFormat::RGBA8, texture.levels[i].width, texture.levels[i].height));
+            CHECK(texture.levels[i].data == decodeLevel(original.levels[i], original.format).pixels);
+        }
+    }
+}
+
+// the container reads back what was written, and rejects stale or corrupt files
+static void checkContainer() {
+    auto path = (std::filesystem::temp_directory_path() / "texture_cooker_test.tex").string();
+    SourceStamp stamp{1234, 5678};
+    auto texture = cookTexture(testImage(37), TextureKind::Color);
+    CHECK(writeCookedTexture(path, texture, stamp, TextureKind::Color));
+
+    auto loaded = loadCookedTexture(path, stamp, TextureKind::Color);
+    CHECK(loaded && loaded->format == texture.format && loaded->levels.size() == texture.levels.size());
+    for (size_t i = 0; i < texture.levels.size(); ++i) {
+        CHECK(loaded->levels[i].width == texture.levels[i].width && loaded->levels[i].height == texture.levels[i].height);
+        CHECK(loaded->levels[i].data == texture.levels[i].data);
+    }
+    CHECK(!loadCookedTexture(path, SourceStamp{1234, 5679}, TextureKind::Color));
+    CHECK(!loadCookedTexture(path, stamp, TextureKind::Linear));
+
+    std::ifstream in{path, std::ios::binary};
+    std::string good{std::istreambuf_iterator<char>{in}, {}};
+    in.close();
+    auto corrupted = [&](size_t offset, uint32_t value) {
+        auto bytes = good;
+        std::memcpy(&bytes[offset], &value, 4);
+        std::ofstream{path, std::ios::binary | std::ios::trunc}.write(bytes.data(), bytes.size());
+        return !loadCookedTexture(path, stamp, TextureKind::Color);
+    };
+    size_t level0 = sizeof(CookedTextureHeader), level1 = (level0 + 16 + texture.levels[0].data.size() + 7) & ~size_t{7};
+    CHECK(corrupted(offsetof(CookedTextureHeader, format), 99));
+    CHECK(corrupted(offsetof(CookedTextureHeader, levelCount), 5));   // stops short of 1x1
+    CHECK(corrupted(offsetof(CookedTextureHeader, levelCount), 1000));
+    CHECK(corrupted(level0, 41));                                      // wider than its data
+    CHECK(corrupted(level0 + 8, uint32_t(texture.levels[0].data.size() - 8))); // size short of the blocks
+    CHECK(corrupted(level1, 19));                                      // does not halve
+    CHECK(!corrupted(level0 + 12, 0));                                 // the size's upper half as it was: still good
+    std::filesystem::remove(path);
+}
+
+int main() {
+    checkCodecs();
+    checkBlockFormats();
+    checkDownsample();
+    checkMipChain();
+    checkDecompressS3TC();
+    checkContainer();
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include <random>
+#include "vertex_format.h"
+#include "check.h"
+
+static float angle(glm::vec3 a, glm::vec3 b) {
+    return std::atan2(glm::length(glm::cross(a, b)), glm::dot(a, b));
+}
+
+// packVertex then unpackVertex over random vertices stays within the bounds PackedVertexData documents
+int main() {
+    std::mt19937 random{1};
+    std::uniform_real_distribution<float> uniform{-1.0f, 1.0f};
+    auto direction = [&] {
+        glm::vec3 v;
+        do v = {uniform(random), uniform(random), uniform(random)}; while (glm::length(v) < 0.1f || glm::length(v) > 1.0f);
+        return glm::normalize(v);
+    };
+
+    PackedBounds bounds{{-1500.0f, -100.0f, -700.0f}, {3000.0f, 1200.0f, 1400.0f}};
+    // half a unorm16 step, and a few float ulps of the bounds for the arithmetic around the quantization
+    glm::vec3 positionBound = bounds.scale * (0.5f / 65535.0f) + (glm::abs(bounds.offset) + bounds.scale) * 1e-6f;
+    for (int i = 0; i < 100000; ++i) {
+        VertexData vertex;
+        vertex.position = bounds.offset + bounds.scale * (glm::vec3{uniform(random), uniform(random), uniform(random)} * 0.5f + 0.5f);
+        vertex.texcoord = {uniform(random) * 8.0f, uniform(random) * 8.0f};
+        vertex.normal = direction();
+        vertex.tangent = glm::normalize(glm::cross(vertex.normal, direction()));
+        vertex.bitangent = glm::cross(vertex.normal, vertex.tangent) * (i % 2 == 0 ? 1.0f : -1.0f);
+
+        auto unpacked = unpackVertex(packVertex(vertex, bounds), bounds);
+
+        auto error = glm::abs(unpacked.position - vertex.position);
+        CHECK(glm::all(glm::lessThanEqual(error, positionBound)));
+        auto texcoordError = glm::abs(unpacked.texcoord - vertex.texcoord);
+        CHECK(glm::all(glm::lessThanEqual(texcoordError, glm::abs(vertex.texcoord) * (1.0f / 2048.0f) + 1e-7f)));
+
+        CHECK(angle(unpacked.normal, vertex.normal) <= 1e-3f);
+        CHECK(angle(unpacked.tangent, vertex.tangent) <= 1e-3f);
+        CHECK(angle(unpacked.bitangent, vertex.bitangent) <= 1e-3f);
+        CHECK(glm::dot(glm::cross(unpacked.normal, unpacked.tangent), unpacked.bitangent) * glm::dot(glm::cross(vertex.normal, vertex.tangent), vertex.bitangent) > 0.0f);
+    }
+    return 0;
+}